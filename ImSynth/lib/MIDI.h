@@ -8,7 +8,8 @@ using namespace std;
 #define noOfMIDINotes (128)
 #define midiNone (128)
 
-#define maxPolyphony (8) // maximum number of notes at once
+#define maxPolyphony (128) // maximum number of notes at once; note slots are allocated for this many
+#define defaultPolyphony (16) // notes at once until changed at runtime (VoiceAllocator)
 
 vector<string> MIDI_number_to_name
 {
@@ -304,10 +305,4 @@ void initMidiPitches()
 	for (int n = 0; n < noOfMIDINotes; n++) {
 		midiPitches[n] = 440 * pow(2, (float(n) - 69.0) / 12.0);
 	}
-}
-
-static vector<int> keyBuffer(maxPolyphony, midiNone);
-
-int findKeyInBuffer(int key) {
-	return find(keyBuffer.begin(), keyBuffer.end(), key) - keyBuffer.begin();
 }
\ No newline at end of file
@@ -0,0 +1,257 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Standard MIDI File loader, types 0 and 1. Every track's note ons and offs are merged
+// into one list in time order and their ticks converted to frames at the given sample
+// rate, through the file's tempo map (or its SMPTE time base). Everything else in the
+// file (controllers, programs, sysex, other meta events) is skipped.
+
+struct midiSongEvent {
+	uint64_t frame;		// from the start of the song
+	uint8_t key;
+	uint8_t velocity;	// 1-127, 0 for a note off
+	uint8_t channel;
+};
+
+struct midiSong {
+	vector<midiSongEvent> events;
+	uint64_t lengthFrames = 0;	// to the last event of any kind, end of track included
+	int notes = 0;
+};
+
+class midiFileReader {
+public:
+	midiFileReader(const vector<uint8_t>& bytes) : data(bytes) {}
+
+	bool read(size_t count, const uint8_t*& out) {
+		if (pos > data.size() || count > data.size() - pos) {
+			return false;
+		}
+		out = &data[pos];
+		pos += count;
+		return true;
+	}
+
+	bool byte(uint8_t& out) {
+		const uint8_t* p;
+		if (!read(1, p)) {
+			return false;
+		}
+		out = *p;
+		return true;
+	}
+
+	bool bigEndian(int bytes, uint32_t& out) {
+		const uint8_t* p;
+		if (!read(bytes, p)) {
+			return false;
+		}
+		out = 0;
+		for (int n = 0; n < bytes; n++) {
+			out = (out << 8) | p[n];
+		}
+		return true;
+	}
+
+	// variable length quantity: 7 bits a byte, top bit set on all but the last, at most 4 bytes
+	bool varLen(uint32_t& out) {
+		out = 0;
+		for (int n = 0; n < 4; n++) {
+			uint8_t b;
+			if (!byte(b)) {
+				return false;
+			}
+			out = (out << 7) | (b & 0x7f);
+			if ((b & 0x80) == 0) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	const vector<uint8_t>& data;
+	size_t pos = 0;
+};
+
+// a note or tempo change at a tick, before the ticks are converted
+struct midiTickEvent {
+	uint64_t tick;
+	int order;			// tempo changes (0) before notes (1) at the same tick; notes keep their file order
+	uint32_t value;		// tempo: microseconds per quarter note
+	uint8_t key;
+	uint8_t velocity;
+	uint8_t channel;
+};
+
+inline bool readMidiTrack(midiFileReader& file, uint32_t length, vector<midiTickEvent>& events, uint64_t& lastTick)
+{
+	const size_t end = file.pos + length;
+	uint64_t tick = 0;
+	uint8_t status = 0;		// running status
+
+	while (file.pos < end) {
+		uint32_t delta;
+		uint8_t b;
+		if (!file.varLen(delta) || !file.byte(b)) {
+			return false;
+		}
+		tick += delta;
+		lastTick = max(lastTick, tick);
+
+		if (b == 0xff) {
+			// meta event: type, length, data
+			uint8_t type;
+			uint32_t len;
+			const uint8_t* p;
+			if (!file.byte(type) || !file.varLen(len) || !file.read(len, p)) {
+				return false;
+			}
+			if (type == 0x51 && len == 3) {
+				midiTickEvent tempo = { tick, 0, (uint32_t)((p[0] << 16) | (p[1] << 8) | p[2]), 0, 0, 0 };
+				events.push_back(tempo);
+			} else if (type == 0x2f) {
+				break;
+			}
+			continue;
+		}
+		if (b == 0xf0 || b == 0xf7) {
+			// sysex: length, data
+			uint32_t len;
+			const uint8_t* p;
+			if (!file.varLen(len) || !file.read(len, p)) {
+				return false;
+			}
+			continue;
+		}
+
+		// channel message, or its data with the previous status byte
+		uint8_t data1;
+		if (b & 0x80) {
+			status = b;
+			if (!file.byte(data1)) {
+				return false;
+			}
+		} else if (status != 0) {
+			data1 = b;
+		} else {
+			return false;
+		}
+		uint8_t data2 = 0;
+		const uint8_t kind = status & 0xf0;
+		if (kind != 0xc0 && kind != 0xd0 && !file.byte(data2)) {
+			return false;
+		}
+
+		if ((kind == 0x90 || kind == 0x80) && data1 < 128) {
+			// note on with velocity 0 is a note off
+			bool on = kind == 0x90 && data2 > 0;
+			midiTickEvent note = { tick, 1, 0, data1, (uint8_t)(on ? data2 : 0), (uint8_t)(status & 0x0f) };
+			events.push_back(note);
+		}
+	}
+	if (file.pos > end) {
+		return false;	// the last event ran past the chunk
+	}
+	file.pos = end;
+	return true;
+}
+
+// the file's contents, already read; path is only for the messages
+inline bool parseMidiFile(const vector<uint8_t>& bytes, const char* path, midiSong& song, int sampleRateHz)
+{
+	midiFileReader file(bytes);
+	const uint8_t* id;
+	uint32_t headerLength, format, tracks, division;
+	if (!file.read(4, id) || string((const char*)id, 4) != "MThd" || !file.bigEndian(4, headerLength) || headerLength < 6
+		|| !file.bigEndian(2, format) || !file.bigEndian(2, tracks) || !file.bigEndian(2, division)) {
+		fprintf(stderr, "Error: %s is not a Standard MIDI File\n", path);
+		return false;
+	}
+	if (format > 1) {
+		fprintf(stderr, "Error: %s is MIDI file type %u; only types 0 and 1 can be played\n", path, format);
+		return false;
+	}
+	file.pos = 8 + headerLength;
+
+	vector<midiTickEvent> events;
+	uint64_t lastTick = 0;
+	for (uint32_t t = 0; t < tracks && file.pos < bytes.size();) {
+		uint32_t length;
+		if (!file.read(4, id) || !file.bigEndian(4, length) || length > bytes.size() - file.pos) {
+			fprintf(stderr, "Error: %s: truncated track chunk\n", path);
+			return false;
+		}
+		if (string((const char*)id, 4) != "MTrk") {
+			file.pos += length;		// unknown chunks are skipped, as the standard asks
+			continue;
+		}
+		if (!readMidiTrack(file, length, events, lastTick)) {
+			fprintf(stderr, "Error: %s: bad event in track %u\n", path, t);
+			return false;
+		}
+		t++;
+	}
+	// a note off at the same tick as its note on (a zero length note, as drum tracks have) must stay
+	// after it, or the on would be left with no off
+	stable_sort(events.begin(), events.end(), [](const midiTickEvent& a, const midiTickEvent& b) {
+		return a.tick < b.tick || (a.tick == b.tick && a.order < b.order);
+	});
+
+	// seconds = seconds at the last tempo change + ticks since it * seconds per tick at that tempo
+	double secondsPerTick;
+	const bool smpte = (division & 0x8000) != 0;
+	if (smpte) {
+		int framesPerSecond = -(int8_t)(division >> 8);
+		double rate = framesPerSecond == 29 ? 30000.0 / 1001.0 : framesPerSecond;
+		secondsPerTick = 1.0 / (rate * max(1u, division & 0xff));
+	} else {
+		secondsPerTick = 0.5 / max(1u, division);	// 120 bpm until a tempo event
+	}
+	uint64_t tempoTick = 0;
+	double tempoSeconds = 0.0;
+	auto toFrame = [&](uint64_t tick) {
+		return (uint64_t)((tempoSeconds + (tick - tempoTick) * secondsPerTick) * sampleRateHz + 0.5);
+	};
+
+	song.events.clear();
+	song.notes = 0;
+	for (const auto& event : events) {
+		if (event.order == 0) {
+			// SMPTE time ignores tempo
+			if (!smpte) {
+				tempoSeconds += (event.tick - tempoTick) * secondsPerTick;
+				tempoTick = event.tick;
+				secondsPerTick = event.value * 1e-6 / max(1u, division);
+			}
+			continue;
+		}
+		midiSongEvent note = { toFrame(event.tick), event.key, event.velocity, event.channel };
+		song.events.push_back(note);
+		song.notes += event.velocity > 0;
+	}
+	song.lengthFrames = toFrame(lastTick);
+	return true;
+}
+
+// false, with a message on stderr, if the file cannot be read or is not SMF type 0 or 1
+inline bool loadMidiFile(const char* path, midiSong& song, int sampleRateHz)
+{
+	FILE* f = fopen(path, "rb");
+	if (f == NULL) {
+		fprintf(stderr, "Error: cannot open MIDI file %s\n", path);
+		return false;
+	}
+	vector<uint8_t> bytes;
+	uint8_t buffer[4096];
+	for (size_t got; (got = fread(buffer, 1, sizeof(buffer), f)) > 0;) {
+		bytes.insert(bytes.end(), buffer, buffer + got);
+	}
+	fclose(f);
+	return parseMidiFile(bytes, path, song, sampleRateHz);
+}
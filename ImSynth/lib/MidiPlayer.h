@@ -0,0 +1,93 @@
+#pragma once
+#include <memory>
+#include "MIDI.h"
+#include "MidiFile.h"
+
+// Plays a midiSong by handing its notes out ahead of time, each with the engine frame it
+// is due at. schedule() is called regularly (every GUI frame, or before every block when
+// rendering offline) with the frame up to which notes are wanted; the engine then applies
+// each one on exactly its frame, however the calls to schedule() happen to fall.
+
+class MidiPlayer {
+public:
+	// from startFrame on, in engine frames
+	void play(shared_ptr<const midiSong> newSong, uint64_t startFrame) {
+		song = newSong;
+		start = startFrame;
+		next = 0;
+		for (int k = 0; k < noOfMIDINotes; k++) {
+			held[k] = 0;
+		}
+		playing = song != nullptr;
+	}
+
+	// note(key, velocity 0-1 (0 for a note off), frame) for every note due before untilFrame,
+	// at most maxNotes of them a call (the rest are handed out next time). note returns false
+	// if it cannot take the note now, and then the same note is handed out again next time
+	template <typename F>
+	void schedule(uint64_t untilFrame, int maxNotes, F note) {
+		if (!playing) {
+			return;
+		}
+		for (; next < song->events.size() && maxNotes > 0; next++, maxNotes--) {
+			const midiSongEvent& event = song->events[next];
+			uint64_t frame = start + event.frame;
+			if (frame >= untilFrame) {
+				return;
+			}
+			// a key played by several channels at once sounds once, until its last note off
+			if (event.velocity > 0) {
+				if (held[event.key] == 0) {
+					if (!note(event.key, event.velocity / 127.0f, frame)) {
+						return;
+					}
+					onFrame[event.key] = frame;
+				}
+				held[event.key]++;
+			} else if (held[event.key] > 0) {
+				if (held[event.key] == 1 && !note(event.key, 0.0f, frame)) {
+					return;
+				}
+				held[event.key]--;
+			}
+		}
+		if (next == song->events.size() && untilFrame >= start + song->lengthFrames) {
+			playing = false;
+		}
+	}
+
+	// note(key, 0, frame) for every key still held, to stop them straight away. The off goes at the
+	// frame its note on was handed out for: an on still waiting in the engine for its frame would
+	// ignore an off that came before it, and then sound for ever; one already played stops now
+	template <typename F>
+	void stop(F note) {
+		for (int k = 0; k < noOfMIDINotes; k++) {
+			if (held[k] > 0) {
+				note(k, 0.0f, onFrame[k]);
+				held[k] = 0;
+			}
+		}
+		playing = false;
+	}
+
+	bool isPlaying() const {
+		return playing;
+	}
+
+	// seconds into the song at engine frame now
+	double position(uint64_t now, int sampleRateHz) const {
+		return now > start ? (double)(now - start) / sampleRateHz : 0.0;
+	}
+
+	const midiSong* getSong() const {
+		return song.get();
+	}
+
+protected:
+	shared_ptr<const midiSong> song;
+	size_t next = 0;		// the next event to hand out
+	uint64_t start = 0;
+	int held[noOfMIDINotes] = {};
+	uint64_t onFrame[noOfMIDINotes] = {};	// the frame each held key's note on went out for
+	bool playing = false;
+};
@@ -0,0 +1,136 @@
+//
+//  AudioTap.h
+//
+//  Lock-free window onto the audio output for the GUI. The audio thread
+//  writes every sample into a ring and then publishes how many it has
+//  written; a reader copies the span it wants and afterwards checks that the
+//  writer has not come round and overwritten it meanwhile. The audio thread
+//  never waits, and a reader never keeps a torn span: it just tries again on
+//  its next frame.
+//
+//  ScopeTrace turns a span of the tap into an oscilloscope trace: aligned to a
+//  rising zero crossing, and reduced to min/max pairs when the window holds
+//  more samples than there are points to plot.
+//
+
+#ifndef AudioTap_h
+#define AudioTap_h
+
+#include <atomic>
+#include <vector>
+#include <algorithm>
+#include <stddef.h>
+#include <stdint.h>
+
+using namespace std;
+
+template <size_t capacity>
+class AudioTap {
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    // samples are published at most this many at a time, and a read keeps clear of the writer by as much
+    static const size_t writeChunk = capacity / 8;
+
+    //
+    // Write: audio side
+    //
+    void write(const float* samples, size_t frames) {
+        uint64_t written = mWritten.load(memory_order_relaxed);
+        while (frames > 0) {
+            size_t chunk = min(frames, writeChunk);
+            for (size_t n = 0; n < chunk; n++) {
+                mSamples[(written + n) & (capacity - 1)].store(samples[n], memory_order_relaxed);
+            }
+            written += chunk;
+            samples += chunk;
+            frames -= chunk;
+            mWritten.store(written, memory_order_release);
+        }
+    }
+
+    // total samples written so far; the newest is at written() - 1
+    uint64_t written() const {
+        return mWritten.load(memory_order_acquire);
+    }
+
+    // the longest span read() can return
+    static size_t maxRead() {
+        return capacity - writeChunk;
+    }
+
+    //
+    // Read: reader side; copies the count samples before end (a value of written()) into dest.
+    // Returns false if some were overwritten before or while they were copied
+    //
+    bool read(float* dest, size_t count, uint64_t end) const {
+        if (count > maxRead() || count > end) {
+            return false;
+        }
+        const uint64_t start = end - count;
+        for (size_t n = 0; n < count; n++) {
+            dest[n] = mSamples[(start + n) & (capacity - 1)].load(memory_order_relaxed);
+        }
+        // the copies above happen before the check below
+        atomic_thread_fence(memory_order_acquire);
+        return mWritten.load(memory_order_relaxed) + writeChunk <= start + capacity;
+    }
+
+protected:
+    // relaxed atomics compile to plain loads and stores; they make the overlapping reads and writes well defined
+    atomic<float> mSamples[capacity] = {};
+    alignas(64) atomic<uint64_t> mWritten{ 0 };
+};
+
+struct ScopeTrace {
+    vector<float> samples;              // the window, and the span before it searched for the trigger
+    vector<float> times;                // each point's time from the start of the window, in seconds
+    vector<float> minimum, maximum;     // each point's lowest and highest sample; equal without decimation
+    int points = 0;
+    int samplesPerPoint = 1;
+    bool triggered = false;             // false when the trace is free running: no crossing was found
+
+    //
+    // Capture: the latest window samples of tap as at most maxPoints points. With trigger, the window
+    // starts at the latest rising zero crossing that still has a whole window after it, searched for
+    // up to a window back. Returns false, keeping the previous trace, if the tap could not be read
+    //
+    template <size_t capacity>
+    bool capture(const AudioTap<capacity>& tap, int window, int maxPoints, bool trigger, float sampleRateHz) {
+        const int searchSpan = trigger ? window : 0;
+        window = max(1, min(window, (int)AudioTap<capacity>::maxRead() - searchSpan));
+        const int span = window + searchSpan;
+
+        samples.resize(span);
+        if (!tap.read(&samples[0], span, tap.written())) {
+            return false;
+        }
+
+        int start = searchSpan;
+        triggered = false;
+        for (int n = searchSpan; trigger && n > 0; n--) {
+            if (samples[n - 1] < 0.0f && samples[n] >= 0.0f) {
+                start = n;
+                triggered = true;
+                break;
+            }
+        }
+
+        samplesPerPoint = max(1, (window + maxPoints - 1) / maxPoints);
+        points = (window + samplesPerPoint - 1) / samplesPerPoint;
+        times.resize(points);
+        minimum.resize(points);
+        maximum.resize(points);
+        for (int p = 0; p < points; p++) {
+            const float* first = &samples[start + p * samplesPerPoint];
+            const float* last = first + min(samplesPerPoint, window - p * samplesPerPoint);
+            auto range = minmax_element(first, last);
+            minimum[p] = *range.first;
+            maximum[p] = *range.second;
+            times[p] = p * samplesPerPoint / sampleRateHz;
+        }
+        return true;
+    }
+};
+
+#endif
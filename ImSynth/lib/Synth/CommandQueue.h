@@ -0,0 +1,62 @@
+//
+//  CommandQueue.h
+//
+//  Wait-free single-producer/single-consumer ring. One thread pushes, one
+//  thread pops; neither ever blocks or allocates.
+//
+
+#ifndef CommandQueue_h
+#define CommandQueue_h
+
+#include <atomic>
+#include <stddef.h>
+
+using namespace std;
+
+template <typename T, size_t capacity>
+class CommandQueue {
+    static_assert((capacity & (capacity - 1)) == 0, "capacity must be a power of two");
+
+public:
+    //
+    // Push: producer side; returns false, dropping the item, if the ring is full
+    //
+    bool push(const T& item) {
+        const size_t head = mHead.load(memory_order_relaxed);
+        if (head - mTail.load(memory_order_acquire) == capacity) {
+            return false;
+        }
+        mItems[head & (capacity - 1)] = item;
+        mHead.store(head + 1, memory_order_release);
+        return true;
+    }
+
+    //
+    // Space: producer side; at least this many pushes will succeed, since the consumer only frees more
+    //
+    size_t space() const {
+        return capacity - (mHead.load(memory_order_relaxed) - mTail.load(memory_order_acquire));
+    }
+
+    //
+    // Pop: consumer side; returns false if there is nothing queued
+    //
+    bool pop(T& item) {
+        const size_t tail = mTail.load(memory_order_relaxed);
+        if (tail == mHead.load(memory_order_acquire)) {
+            return false;
+        }
+        item = mItems[tail & (capacity - 1)];
+        mTail.store(tail + 1, memory_order_release);
+        return true;
+    }
+
+protected:
+    T mItems[capacity];
+
+    // head and tail on separate cache lines so the two threads don't share one
+    alignas(64) atomic<size_t> mHead{ 0 };
+    alignas(64) atomic<size_t> mTail{ 0 };
+};
+
+#endif
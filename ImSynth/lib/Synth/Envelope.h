@@ -0,0 +1,313 @@
+//
+//  Envelope.h
+//
+//  ADSR amplitude envelopes, one per note slot and shared by every stack.
+//  Levels are worked out at control rate, every envelopeInterval frames, four
+//  slots at a time with SIMD; in between, the kernels step each note's gain
+//  sample by sample along a straight line. The updates fall on fixed engine
+//  frames, so the result does not depend on how the audio is cut into blocks.
+//
+//  Attack rises linearly to full level. Decay falls exponentially to the
+//  sustain level and release to silence, each getting within envelopeSilence
+//  of where it is heading in its set time. When a release ends the envelope
+//  reports it, and the engine stops rendering the note and frees its slot.
+//
+//  Uses the SIMD switch and block size from WaveTableOscPoly.h, which includes this.
+//
+
+#ifndef Envelope_h
+#define Envelope_h
+
+#ifndef useSIMDKernel
+#error "include WaveTableOscPoly.h rather than Envelope.h"
+#endif
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+#include "MIDI.h"
+
+using namespace std;
+
+#define envelopeInterval (32)       // frames between envelope updates
+#define envelopeSilence (1e-4f)     // -80 dB: the level a release ends at
+#define maxEnvelopeSegments (maxBlockSize / envelopeInterval + 2)
+
+enum envelopeStage {
+    envIdle,
+    envAttack,
+    envDecay,       // and then sustain
+    envRelease,
+};
+
+struct adsrSettings {
+    float attack = 0.005f;  // seconds
+    float decay = 0.2f;     // seconds
+    float sustain = 1.0f;   // level, 0-1
+    float release = 0.05f;  // seconds
+};
+
+//
+// One block of envelopes, for the kernels: the block is cut into count segments at the envelope
+// updates, and frame n of segment s (counting from 0) has slot p at level[s][p] + step[s][p] * (n + 1).
+// Segments that start on an update are marked, for other control-rate values to be refreshed on the
+// same frames
+//
+struct envelopeSegments {
+    alignas(16) float level[maxEnvelopeSegments][maxPolyphony];
+    alignas(16) float step[maxEnvelopeSegments][maxPolyphony];
+    int length[maxEnvelopeSegments];
+    bool update[maxEnvelopeSegments];
+    int count = 0;
+
+    // a single segment at full level, as long as any block, for rendering without envelopes
+    static const envelopeSegments& unity() {
+        static const envelopeSegments segments = [] {
+            envelopeSegments s;
+            fill(&s.level[0][0], &s.level[0][0] + maxPolyphony, 1.0f);
+            fill(&s.step[0][0], &s.step[0][0] + maxPolyphony, 0.0f);
+            s.length[0] = maxBlockSize;
+            s.update[0] = true;
+            s.count = 1;
+            return s;
+        }();
+        return segments;
+    }
+};
+
+class EnvelopeBank {
+public:
+    EnvelopeBank() {
+        fill(begin(mLevel), end(mLevel), 0.0f);
+        fill(begin(mStep), end(mStep), 0.0f);
+        fill(begin(mTarget), end(mTarget), 0.0f);
+        fill(begin(mStage), end(mStage), (int32_t)envIdle);
+        setSettings(adsrSettings());
+    }
+
+    EnvelopeBank(const EnvelopeBank&) = delete;
+    EnvelopeBank& operator=(const EnvelopeBank&) = delete;
+
+    // takes effect from the next update, for every slot
+    void setSettings(const adsrSettings& settings) {
+        mSettings = settings;
+        mSettings.sustain = max(0.0f, min(settings.sustain, 1.0f));
+        mAttackStep = 1.0f / (max(settings.attack, 0.0005f) * sampleRate);
+        mDecayCoef = pow(envelopeSilence, 1.0f / (max(settings.decay, 0.001f) * sampleRate));
+        mReleaseCoef = pow(envelopeSilence, 1.0f / (max(settings.release, 0.001f) * sampleRate));
+        mAttackTick = mAttackStep * envelopeInterval;
+        mDecayTick = pow(mDecayCoef, (float)envelopeInterval);
+        mReleaseTick = pow(mReleaseCoef, (float)envelopeInterval);
+    }
+
+    const adsrSettings& getSettings() const {
+        return mSettings;
+    }
+
+    //
+    // Audio side, between blocks: a note starts (attacking from wherever the slot's level is, so a
+    // stolen slot does not click) or is released
+    //
+    void noteOn(int slot) {
+        if (mStage[slot] == envIdle) {
+            mActive++;
+        }
+        restart(slot, envAttack);
+    }
+
+    void noteOff(int slot) {
+        if (mStage[slot] != envIdle) {
+            restart(slot, envRelease);
+        }
+    }
+
+    bool isActive(int slot) const {
+        return mStage[slot] != envIdle;
+    }
+
+    //
+    // Render: the envelopes for up to the next frames (at most maxBlockSize) into segments, moving them
+    // on, and returns how many frames that was. It stops short at an update where a release ends, so
+    // that the next block starts there: ended(slot) is then called for each such slot as the block
+    // starts, and the note stops on exactly the same frame however the audio is cut into blocks
+    //
+    template <typename F>
+    int render(int frames, envelopeSegments& segments, F ended) {
+        segments.count = 0;
+        int n = 0;
+        while (n < frames) {
+            const bool updating = mPosition == mNextUpdate;
+            if (updating) {
+                if (n > 0 && releaseEnding()) {
+                    break;
+                }
+                update(ended);
+                mNextUpdate += envelopeInterval;
+            }
+            const int length = (int)min((uint64_t)(frames - n), mNextUpdate - mPosition);
+            const int s = segments.count++;
+            segments.length[s] = length;
+            segments.update[s] = updating;
+            // with nothing sounding nothing reads the levels
+            if (mActive > 0) {
+                copy(begin(mLevel), end(mLevel), segments.level[s]);
+                copy(begin(mStep), end(mStep), segments.step[s]);
+                for (int p = 0; p < maxPolyphony; p++) {
+                    mLevel[p] += mStep[p] * length;
+                }
+            }
+            mPosition += length;
+            n += length;
+        }
+        return n;
+    }
+
+protected:
+    // a new stage from the current level, heading for where it will be at the next update
+    void restart(int slot, envelopeStage stage) {
+        mStage[slot] = stage;
+        const int frames = (int)(mNextUpdate - mPosition);
+        if (frames == 0) {
+            // the update about to happen takes it from here
+            mTarget[slot] = mLevel[slot];
+            mStep[slot] = 0.0f;
+            return;
+        }
+        int32_t nextStage = stage;
+        mTarget[slot] = evolve(mLevel[slot], nextStage, mAttackStep * frames, pow(mDecayCoef, (float)frames), pow(mReleaseCoef, (float)frames));
+        mStage[slot] = nextStage;
+        mStep[slot] = (mTarget[slot] - mLevel[slot]) / frames;
+    }
+
+    // true if a release reaches silence at the next update
+    bool releaseEnding() const {
+        if (mActive == 0) {
+            return false;
+        }
+        for (int p = 0; p < maxPolyphony; p++) {
+            if (mStage[p] == envRelease && mTarget[p] == 0.0f) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    // where level gets to in one step of a stage, and the stage it is in by then
+    float evolve(float level, int32_t& stage, float attackStep, float decayCoef, float releaseCoef) const {
+        switch (stage) {
+        case envAttack:
+            level += attackStep;
+            if (level >= 1.0f) {
+                level = 1.0f;
+                stage = envDecay;
+            }
+            return level;
+        case envDecay:
+            return mSettings.sustain + (level - mSettings.sustain) * decayCoef;
+        case envRelease:
+            level *= releaseCoef;
+            return level < envelopeSilence ? 0.0f : level;
+        default:
+            return 0.0f;
+        }
+    }
+
+    // every active slot lands on its target and heads for the next one, envelopeInterval frames on
+    template <typename F>
+    void update(F ended) {
+        if (mActive == 0) {
+            return;
+        }
+        const float stepScale = 1.0f / envelopeInterval;
+#if useSIMDKernel
+        const __m128i idle = _mm_set1_epi32(envIdle);
+        const __m128i attack = _mm_set1_epi32(envAttack);
+        const __m128i decay = _mm_set1_epi32(envDecay);
+        const __m128i release = _mm_set1_epi32(envRelease);
+        const __m128 zero = _mm_setzero_ps();
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 attackTick = _mm_set1_ps(mAttackTick);
+        const __m128 decayTick = _mm_set1_ps(mDecayTick);
+        const __m128 releaseTick = _mm_set1_ps(mReleaseTick);
+        const __m128 sustain = _mm_set1_ps(mSettings.sustain);
+        const __m128 silence = _mm_set1_ps(envelopeSilence);
+        const __m128 scale = _mm_set1_ps(stepScale);
+
+        for (int p = 0; p < maxPolyphony; p += 4) {
+            __m128i stage = _mm_load_si128((const __m128i*)&mStage[p]);
+            const __m128 isIdle = _mm_castsi128_ps(_mm_cmpeq_epi32(stage, idle));
+            if (_mm_movemask_ps(isIdle) == 0xf) {
+                continue;
+            }
+            const __m128 isAttack = _mm_castsi128_ps(_mm_cmpeq_epi32(stage, attack));
+            const __m128 isDecay = _mm_castsi128_ps(_mm_cmpeq_epi32(stage, decay));
+            const __m128 isRelease = _mm_castsi128_ps(_mm_cmpeq_epi32(stage, release));
+            const __m128 level = _mm_load_ps(&mTarget[p]);
+
+            // a release that reached silence at this update has ended
+            const __m128 isEnded = _mm_and_ps(isRelease, _mm_cmpeq_ps(level, zero));
+            int endedLanes = _mm_movemask_ps(isEnded);
+
+            // every stage's next level, then each lane takes its own
+            const __m128 attackNext = _mm_min_ps(_mm_add_ps(level, attackTick), one);
+            const __m128 decayNext = _mm_add_ps(sustain, _mm_mul_ps(_mm_sub_ps(level, sustain), decayTick));
+            __m128 releaseNext = _mm_mul_ps(level, releaseTick);
+            releaseNext = _mm_and_ps(releaseNext, _mm_cmpge_ps(releaseNext, silence));
+            const __m128 next = _mm_or_ps(_mm_or_ps(_mm_and_ps(isAttack, attackNext), _mm_and_ps(isDecay, decayNext)),
+                _mm_andnot_ps(isEnded, _mm_and_ps(isRelease, releaseNext)));
+
+            // attacks at full level move on to decay, ended releases to idle
+            const __m128i attackDone = _mm_castps_si128(_mm_and_ps(isAttack, _mm_cmpge_ps(attackNext, one)));
+            stage = _mm_add_epi32(stage, _mm_and_si128(attackDone, _mm_sub_epi32(decay, attack)));
+            stage = _mm_andnot_si128(_mm_castps_si128(isEnded), stage);
+            _mm_store_si128((__m128i*)&mStage[p], stage);
+
+            _mm_store_ps(&mLevel[p], level);
+            _mm_store_ps(&mTarget[p], next);
+            _mm_store_ps(&mStep[p], _mm_mul_ps(_mm_sub_ps(next, level), scale));
+
+            for (; endedLanes != 0; endedLanes &= endedLanes - 1) {
+                int lane = 0;
+                while (((endedLanes >> lane) & 1) == 0) {
+                    lane++;
+                }
+                mActive--;
+                ended(p + lane);
+            }
+        }
+#else
+        for (int p = 0; p < maxPolyphony; p++) {
+            if (mStage[p] == envIdle) {
+                continue;
+            }
+            const float level = mTarget[p];
+            mLevel[p] = level;
+            if (mStage[p] == envRelease && level == 0.0f) {
+                mStage[p] = envIdle;
+                mTarget[p] = mStep[p] = 0.0f;
+                mActive--;
+                ended(p);
+                continue;
+            }
+            mTarget[p] = evolve(level, mStage[p], mAttackTick, mDecayTick, mReleaseTick);
+            mStep[p] = (mTarget[p] - level) * stepScale;
+        }
+#endif
+    }
+
+    // per slot, as structure-of-arrays for the SIMD update
+    alignas(16) float mLevel[maxPolyphony];     // at the frame about to be rendered
+    alignas(16) float mStep[maxPolyphony];      // per frame, until the next update
+    alignas(16) float mTarget[maxPolyphony];    // at the next update
+    alignas(16) int32_t mStage[maxPolyphony];
+
+    adsrSettings mSettings;
+    float mAttackStep, mDecayCoef, mReleaseCoef;    // per frame
+    float mAttackTick, mDecayTick, mReleaseTick;    // per envelopeInterval frames
+    uint64_t mPosition = 0;     // engine frames rendered
+    uint64_t mNextUpdate = 0;   // frame of the next update, a multiple of envelopeInterval
+    int mActive = 0;            // slots not idle
+};
+
+#endif
@@ -0,0 +1,110 @@
+//
+//  LoadMeter.h
+//
+//  Audio callback load: how much of each buffer's deadline the callback used,
+//  plus an xrun count. The audio thread writes, the GUI reads; everything
+//  shared is an atomic, and neither side ever waits for the other.
+//
+
+#ifndef LoadMeter_h
+#define LoadMeter_h
+
+#include <atomic>
+#include <chrono>
+#include <stdint.h>
+
+using namespace std;
+
+#define loadHistogramBins (200)    // 1% bins; the last one also counts every overload beyond it
+
+class LoadMeter {
+public:
+    LoadMeter() {
+        for (auto& bin : mHistogram) {
+            bin.store(0, memory_order_relaxed);
+        }
+    }
+
+    //
+    // audio side: bracket the callback's work
+    //
+    chrono::steady_clock::time_point beginCallback() {
+        if (mResetRequested.exchange(false, memory_order_acquire)) {
+            for (auto& bin : mHistogram) {
+                bin.store(0, memory_order_relaxed);
+            }
+            mPeak.store(0.0f, memory_order_relaxed);
+            mXruns.store(0, memory_order_relaxed);
+        }
+        return chrono::steady_clock::now();
+    }
+
+    // deadline is the time the buffer takes to play, i.e. frames / sample rate
+    void endCallback(chrono::steady_clock::time_point start, double deadlineSeconds) {
+        double used = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+        float load = (float)(used / deadlineSeconds);
+
+        mCurrent.store(load, memory_order_relaxed);
+        if (load > mPeak.load(memory_order_relaxed)) {
+            mPeak.store(load, memory_order_relaxed);
+        }
+        int bin = (int)(load * 100.0f);
+        bin = bin < 0 ? 0 : (bin >= loadHistogramBins ? loadHistogramBins - 1 : bin);
+        mHistogram[bin].fetch_add(1, memory_order_relaxed);
+    }
+
+    void countXrun() {
+        mXruns.fetch_add(1, memory_order_relaxed);
+    }
+
+    //
+    // GUI side; loads are fractions of the deadline (1.0 = the whole buffer time)
+    //
+    float current() const {
+        return mCurrent.load(memory_order_relaxed);
+    }
+
+    float peak() const {
+        return mPeak.load(memory_order_relaxed);
+    }
+
+    uint32_t xruns() const {
+        return mXruns.load(memory_order_relaxed);
+    }
+
+    // load that the given fraction (e.g. 0.99) of callbacks stayed under, to 1% resolution
+    float percentile(double fraction) const {
+        uint64_t counts[loadHistogramBins];
+        uint64_t total = 0;
+        for (int n = 0; n < loadHistogramBins; n++) {
+            counts[n] = mHistogram[n].load(memory_order_relaxed);
+            total += counts[n];
+        }
+        if (total == 0) {
+            return 0.0f;
+        }
+        uint64_t target = (uint64_t)(fraction * total);
+        uint64_t seen = 0;
+        for (int n = 0; n < loadHistogramBins; n++) {
+            seen += counts[n];
+            if (seen > target) {
+                return (n + 1) / 100.0f;
+            }
+        }
+        return loadHistogramBins / 100.0f;
+    }
+
+    // applied by the audio thread at its next callback
+    void reset() {
+        mResetRequested.store(true, memory_order_release);
+    }
+
+protected:
+    atomic<float> mCurrent{ 0.0f };
+    atomic<float> mPeak{ 0.0f };
+    atomic<uint32_t> mXruns{ 0 };
+    atomic<uint32_t> mHistogram[loadHistogramBins];
+    atomic<bool> mResetRequested{ false };
+};
+
+#endif
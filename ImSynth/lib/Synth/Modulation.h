@@ -0,0 +1,190 @@
+//
+//  Modulation.h
+//
+//  LFOs and the modulation matrix. Modulation is worked out at control rate,
+//  once every controlInterval frames, on fixed engine frames so that renders
+//  do not depend on the block size: each tick gives every stack the offsets
+//  its parameters will have at the next tick. Only amplitude, which would
+//  zipper, is interpolated between ticks, on the stack's own amplitude ramp;
+//  detune, pan, shape and filter cutoff step at the ticks. With every depth
+//  at 0 there are no ticks, and blocks are not split.
+//
+//  The LFOs are global and free running, and their phases follow from the
+//  engine frame, so any tick can be evaluated directly.
+//
+
+#ifndef Modulation_h
+#define Modulation_h
+
+#include <algorithm>
+#include <math.h>
+#include <stdint.h>
+
+#include "WaveTableOscPoly.h"
+
+using namespace std;
+
+#define numberOfLFOs (2)
+#define minControlInterval (16)     // frames between modulation ticks
+#define maxControlInterval (64)
+#define defaultControlInterval (32)
+
+enum lfoWave {
+    lfoSine,
+    lfoTriangle,
+    lfoSaw,
+    lfoSquare,
+    lfoSampleAndHold,   // a new random level every cycle
+    numberOfLfoWaves
+};
+
+enum modDestination {
+    modAmplitude,
+    modDetune,
+    modPan,
+    modShape,
+    modCutoff,
+    numberOfModDestinations
+};
+
+// how far each destination moves with depth 1 at the top of the LFO's swing
+static const float modRange[numberOfModDestinations] = {
+    1.0f,                           // amplitude: a gain of 0 to 2 on the amplitude as set
+    100.0f,                         // unison detune, 0-100 as on the slider
+    100.0f,                         // pan, -100 to 100
+    (float)(numberOfShapes - 1),    // shape, through every shape
+    4.0f,                           // filter cutoff, in octaves
+};
+
+// one tick's modulation of one stack: offsets from its parameters as set, by modDestination
+struct stackModulation {
+    float offset[numberOfModDestinations];
+};
+
+class ModulationMatrix {
+public:
+    ModulationMatrix() {
+        fill(&mDepth[0][0][0], &mDepth[0][0][0] + numberOfLFOs * maxOscStacks * numberOfModDestinations, 0.0f);
+        for (int lfo = 0; lfo < numberOfLFOs; lfo++) {
+            mWave[lfo] = lfoSine;
+            mRate[lfo] = 1.0f;
+            mBaseCycles[lfo] = 0.0;
+            mBaseFrame[lfo] = 0;
+        }
+    }
+
+    ModulationMatrix(const ModulationMatrix&) = delete;
+    ModulationMatrix& operator=(const ModulationMatrix&) = delete;
+
+    // audio side, between blocks; a new rate carries on from the LFO's phase now
+    void setRate(int lfo, float hz) {
+        mBaseCycles[lfo] = lfoCycles(lfo, mPosition);
+        mBaseFrame[lfo] = mPosition;
+        mRate[lfo] = max(0.0f, hz);
+    }
+
+    void setWave(int lfo, int wave) {
+        mWave[lfo] = max(0, min(wave, numberOfLfoWaves - 1));
+    }
+
+    // depth -1 to 1 of one LFO on one stack's destination
+    void setDepth(int lfo, int stack, int destination, float depth) {
+        float& cell = mDepth[lfo][stack][destination];
+        mActiveDepths += (depth != 0.0f) - (cell != 0.0f);
+        cell = max(-1.0f, min(depth, 1.0f));
+    }
+
+    // takes effect from the next tick
+    void setInterval(int frames) {
+        mInterval = max(minControlInterval, min(frames, maxControlInterval));
+    }
+
+    int getInterval() const {
+        return mInterval;
+    }
+
+    bool isActive() const {
+        return mActiveDepths > 0;
+    }
+
+    //
+    // Render: how many of the next frames to render, at most frames. While any depth is set it stops at
+    // the next tick, and on a tick apply(stack, modulation, frames) is called for every stack with its
+    // modulation at the next tick, frames on. Call advance once they have been rendered
+    //
+    template <typename F>
+    int render(int frames, F apply) {
+        if (!isActive()) {
+            return frames;
+        }
+        const int sinceTick = (int)(mPosition % mInterval);
+        if (sinceTick == 0) {
+            tick(mPosition + mInterval, apply);
+        }
+        return min(frames, mInterval - sinceTick);
+    }
+
+    void advance(int frames) {
+        mPosition += frames;
+    }
+
+protected:
+    template <typename F>
+    void tick(uint64_t frame, F apply) {
+        float value[numberOfLFOs];
+        for (int lfo = 0; lfo < numberOfLFOs; lfo++) {
+            value[lfo] = lfoValue(lfo, frame);
+        }
+        for (int stack = 0; stack < maxOscStacks; stack++) {
+            stackModulation modulation;
+            for (int d = 0; d < numberOfModDestinations; d++) {
+                float sum = 0.0f;
+                for (int lfo = 0; lfo < numberOfLFOs; lfo++) {
+                    sum += mDepth[lfo][stack][d] * value[lfo];
+                }
+                modulation.offset[d] = sum * modRange[d];
+            }
+            apply(stack, modulation, mInterval);
+        }
+    }
+
+    // cycles the LFO has run through by engine frame
+    double lfoCycles(int lfo, uint64_t frame) const {
+        return mBaseCycles[lfo] + mRate[lfo] * (double)(frame - mBaseFrame[lfo]) / sampleRate;
+    }
+
+    // -1 to 1, at engine frame
+    float lfoValue(int lfo, uint64_t frame) const {
+        const double cycles = lfoCycles(lfo, frame);
+        const double phase = cycles - floor(cycles);
+        switch (mWave[lfo]) {
+        case lfoTriangle:
+            return (float)(1.0 - 4.0 * fabs(phase - 0.5));
+        case lfoSaw:
+            return (float)(2.0 * phase - 1.0);
+        case lfoSquare:
+            return phase < 0.5 ? 1.0f : -1.0f;
+        case lfoSampleAndHold: {
+            // the same level for the same cycle, however the ticks fall (splitmix64 of the cycle number)
+            uint64_t x = (uint64_t)(int64_t)floor(cycles) * 2 + lfo + 0x9e3779b97f4a7c15ull;
+            x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ull;
+            x = (x ^ (x >> 27)) * 0x94d049bb133111ebull;
+            x ^= x >> 31;
+            return (float)(x >> 40) * (2.0f / 16777216.0f) - 1.0f;
+        }
+        default:
+            return (float)sin(2.0 * M_PI * phase);
+        }
+    }
+
+    float mDepth[numberOfLFOs][maxOscStacks][numberOfModDestinations];
+    int mActiveDepths = 0;      // depths that are not 0
+    int mWave[numberOfLFOs];
+    float mRate[numberOfLFOs];  // Hz
+    double mBaseCycles[numberOfLFOs];   // cycles run through by mBaseFrame, when the rate was last set
+    uint64_t mBaseFrame[numberOfLFOs];
+    int mInterval = defaultControlInterval;
+    uint64_t mPosition = 0;     // engine frames rendered
+};
+
+#endif
@@ -0,0 +1,96 @@
+//
+//  NoteFilter.h
+//
+//  Resonant state variable filter, one per note slot and channel, run on each
+//  note's unison sum before its envelope. The filter is the trapezoidal
+//  (zero delay feedback) SVF, which stays stable and keeps its tuning right
+//  up to Nyquist and at any resonance. One call filters noteLanes notes, one
+//  per SIMD lane; the coefficients only change at control rate, so the
+//  per-sample work is a handful of multiplies and adds per lane.
+//
+//  Uses the SIMD switch from WaveTableOscPoly.h, which includes this.
+//
+
+#ifndef NoteFilter_h
+#define NoteFilter_h
+
+#ifndef useSIMDKernel
+#error "include WaveTableOscPoly.h rather than NoteFilter.h"
+#endif
+
+#include <algorithm>
+#include <math.h>
+
+using namespace std;
+
+#define filterMinCutoff (20.0f)         // Hz
+#define filterMaxCutoff (20000.0f)      // Hz, and never above 0.45 of the sample rate
+#define filterKeyCentre (261.63f)       // Hz: middle C keeps the cutoff as set, whatever the key tracking
+
+enum filterMode {
+    filterOff,
+    filterLowPass,
+    filterBandPass,
+    filterHighPass,
+    numberOfFilterModes
+};
+
+// damping, 2 (no resonance) down to 0.04 (a Q of 25), for resonance 0-1
+inline float filterDamping(float resonance) {
+    return 2.0f * (1.0f - 0.98f * max(0.0f, min(resonance, 1.0f)));
+}
+
+// g for a cutoff in Hz, kept within the filter's range
+inline float filterCoefficient(float cutoffHz) {
+    cutoffHz = max(filterMinCutoff, min(cutoffHz, min(filterMaxCutoff, 0.45f * sampleRate)));
+    return tanf((float)M_PI * cutoffHz / sampleRate);
+}
+
+//
+// The output is m0 * input + m1 * band + m2 * low; the band pass is scaled by the damping so that
+// it peaks at unity gain
+//
+struct filterMix {
+    float m0, m1, m2;
+
+    filterMix(int mode, float damping) {
+        switch (mode) {
+        case filterBandPass:
+            m0 = 0.0f; m1 = damping; m2 = 0.0f;
+            break;
+        case filterHighPass:
+            m0 = 1.0f; m1 = -damping; m2 = -1.0f;
+            break;
+        default:
+            m0 = 0.0f; m1 = 0.0f; m2 = 1.0f;
+            break;
+        }
+    }
+};
+
+//
+// One sample through the filter: ic1 and ic2 are its two integrator states, a1-a3 come from g and
+// the damping k as a1 = 1 / (1 + g * (g + k)), a2 = g * a1, a3 = g * a2
+//
+inline float svfTick(float v0, float& ic1, float& ic2, float a1, float a2, float a3, const filterMix& mix) {
+    float v3 = v0 - ic2;
+    float v1 = a1 * ic1 + a2 * v3;
+    float v2 = ic2 + a2 * ic1 + a3 * v3;
+    ic1 = 2.0f * v1 - ic1;
+    ic2 = 2.0f * v2 - ic2;
+    return mix.m0 * v0 + mix.m1 * v1 + mix.m2 * v2;
+}
+
+#if useSIMDKernel
+// the same, for noteLanes notes at once
+inline __m128 svfTick(__m128 v0, __m128& ic1, __m128& ic2, __m128 a1, __m128 a2, __m128 a3, __m128 m0, __m128 m1, __m128 m2) {
+    __m128 v3 = _mm_sub_ps(v0, ic2);
+    __m128 v1 = _mm_add_ps(_mm_mul_ps(a1, ic1), _mm_mul_ps(a2, v3));
+    __m128 v2 = _mm_add_ps(_mm_add_ps(ic2, _mm_mul_ps(a2, ic1)), _mm_mul_ps(a3, v3));
+    ic1 = _mm_sub_ps(_mm_add_ps(v1, v1), ic1);
+    ic2 = _mm_sub_ps(_mm_add_ps(v2, v2), ic2);
+    return _mm_add_ps(_mm_add_ps(_mm_mul_ps(m0, v0), _mm_mul_ps(m1, v1)), _mm_mul_ps(m2, v2));
+}
+#endif
+
+#endif
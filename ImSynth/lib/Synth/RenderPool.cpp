@@ -0,0 +1,162 @@
+//
+//  RenderPool.cpp
+//
+
+#include <algorithm>
+#include <chrono>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define spinPause() _mm_pause()
+#else
+#define spinPause() ((void)0)
+#endif
+
+#include "RenderPool.h"
+
+using namespace std;
+
+#define workerSpinTime (0.02)   // seconds a worker keeps spinning after its last batch before it starts sleeping
+
+// best effort: without the privilege to raise it the thread just keeps its normal priority
+static void raiseThreadPriority() {
+#ifdef _WIN32
+    SetThreadPriority(GetCurrentThread(), THREAD_PRIORITY_TIME_CRITICAL);
+#else
+    sched_param param;
+    param.sched_priority = sched_get_priority_max(SCHED_FIFO) - 1;
+    pthread_setschedparam(pthread_self(), SCHED_FIFO, &param);
+#endif
+}
+
+void RenderPool::start(int workers) {
+    stop();
+    // more threads than cores would only take turns, with the audio thread waiting on each
+    const int cores = max(1, (int)thread::hardware_concurrency());
+    workers = max(0, min(workers, min(cores, maxRenderThreads) - 1));
+    mRunning.store(true);
+    for (int n = 0; n < workers; n++) {
+        mThreads.emplace_back(&RenderPool::workerLoop, this, n + 1);
+    }
+}
+
+void RenderPool::stop() {
+    {
+        lock_guard<mutex> lock(mWakeMutex);
+        mRunning.store(false);
+    }
+    mWakeCondition.notify_all();
+    for (auto& t : mThreads) {
+        t.join();
+    }
+    mThreads.clear();
+    mActiveThreads.store(1);
+    mAwakeThreads.store(1);
+}
+
+void RenderPool::wake(int threads) {
+    {
+        lock_guard<mutex> lock(mWakeMutex);
+        mAwakeThreads.store(max(1, min(threads, workerCount() + 1)), memory_order_relaxed);
+    }
+    mWakeCondition.notify_all();
+}
+
+void RenderPool::setActiveThreads(int threads) {
+    mActiveThreads.store(max(1, min(threads, workerCount() + 1)), memory_order_relaxed);
+}
+
+void RenderPool::run(taskFunction function, void* context, int numTasks, double maxWait) {
+    // every task of the previous batch has finished, so no other thread is reading these
+    mFunction = function;
+    mContext = context;
+    mDone.store(0, memory_order_relaxed);
+    mGeneration++;
+    mBatch.store(((uint64_t)mGeneration << 32) | ((uint64_t)numTasks << 16), memory_order_release);
+
+    runTasks(0, mGeneration);
+
+    // the tasks still running on workers are the last ones claimed, so this wait is short while each
+    // worker has its core. If one has been kept from it, the audio thread yields its own to let it finish
+    if (mDone.load(memory_order_acquire) < numTasks) {
+        const auto deadline = chrono::steady_clock::now() + chrono::duration<double>(maxWait);
+        bool late = false;
+        while (mDone.load(memory_order_acquire) < numTasks) {
+            if (late) {
+                this_thread::yield();
+                continue;
+            }
+            for (int n = 0; n < 64; n++) {
+                spinPause();
+            }
+            if (chrono::steady_clock::now() > deadline) {
+                late = true;
+                mBackoff = backoffRuns;
+            }
+        }
+    }
+}
+
+void RenderPool::runTasks(int thread, uint32_t generation) {
+    uint64_t batch = mBatch.load(memory_order_acquire);
+    for (;;) {
+        int next = (int)(batch & 0xffff);
+        int numTasks = (int)((batch >> 16) & 0xffff);
+        if ((uint32_t)(batch >> 32) != generation || next >= numTasks) {
+            return;
+        }
+        // on failure batch is reloaded with the current value
+        if (mBatch.compare_exchange_weak(batch, batch + 1, memory_order_acquire, memory_order_acquire)) {
+            mFunction(mContext, next, thread);
+            mDone.fetch_add(1, memory_order_release);
+            batch = mBatch.load(memory_order_acquire);
+        }
+    }
+}
+
+void RenderPool::workerLoop(int thread) {
+    raiseThreadPriority();
+
+    uint32_t seen = (uint32_t)(mBatch.load(memory_order_acquire) >> 32);
+    auto lastWork = chrono::steady_clock::now();
+
+    while (mRunning.load(memory_order_relaxed)) {
+        if (thread >= mAwakeThreads.load(memory_order_relaxed)) {
+            unique_lock<mutex> lock(mWakeMutex);
+            mWakeCondition.wait(lock, [&] { return !mRunning.load(memory_order_relaxed) || thread < mAwakeThreads.load(memory_order_relaxed); });
+            seen = (uint32_t)(mBatch.load(memory_order_acquire) >> 32);
+            lastWork = chrono::steady_clock::now();
+            continue;
+        }
+        // woken, until the audio thread takes up the new thread count
+        if (thread >= mActiveThreads.load(memory_order_relaxed)) {
+            this_thread::sleep_for(chrono::milliseconds(2));
+            continue;
+        }
+
+        uint32_t generation = (uint32_t)(mBatch.load(memory_order_acquire) >> 32);
+        if (generation != seen) {
+            seen = generation;
+            runTasks(thread, generation);
+            lastWork = chrono::steady_clock::now();
+            continue;
+        }
+
+        // spinning keeps the wake-up time well inside a block while the audio is running
+        for (int n = 0; n < 64; n++) {
+            spinPause();
+        }
+        if (chrono::duration<double>(chrono::steady_clock::now() - lastWork).count() > workerSpinTime) {
+            this_thread::sleep_for(chrono::milliseconds(1));
+        }
+    }
+}
@@ -0,0 +1,105 @@
+//
+//  RenderPool.h
+//
+//  Worker threads that help the audio thread render a block. The audio thread
+//  publishes a batch of numbered tasks and works on them too; every thread takes
+//  the next unclaimed task until none are left, so a thread that finishes early
+//  takes work that would otherwise have waited for a slower one. Claiming a task
+//  is a single compare-and-swap, and nothing on the audio side ever blocks.
+//
+//  Workers spin while blocks are arriving and drop back to short sleeps when
+//  there has been no work for a while. Workers not asked for with wake() block
+//  until they are, so a pool that is not in use costs nothing.
+//
+//  There are never more threads than cores, but a worker can still be kept
+//  off its core. If a run waits past its deadline for workers to finish, the
+//  audio thread gives up its core while it waits, and the next backoffRuns
+//  runs are left to it alone.
+//
+
+#ifndef RenderPool_h
+#define RenderPool_h
+
+#include <atomic>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+#include <vector>
+#include <stdint.h>
+
+using namespace std;
+
+#define maxRenderThreads (16)   // including the audio thread
+#define backoffRuns (256)       // runs on the audio thread alone after one that waited too long
+
+class RenderPool {
+public:
+    // task is the index within the batch; thread is 0 for the audio thread, 1 and up for the workers
+    typedef void (*taskFunction)(void* context, int task, int thread);
+
+    RenderPool() {}
+    ~RenderPool() {
+        stop();
+    }
+
+    RenderPool(const RenderPool&) = delete;
+    RenderPool& operator=(const RenderPool&) = delete;
+
+    // call before the audio stream starts, and stop() after it has stopped; the workers start blocked.
+    // There are at most as many workers as cores besides the audio thread's
+    void start(int workers);
+    void stop();
+
+    // control side: wakes the workers needed for threads threads, the audio thread included, ahead of
+    // setActiveThreads; the others block until they are needed again
+    void wake(int threads);
+
+    int workerCount() const {
+        return (int)mThreads.size();
+    }
+
+    // threads that take part in run(), the audio thread included; 1 renders on the audio thread alone
+    void setActiveThreads(int threads);
+
+    int activeThreads() const {
+        return mActiveThreads.load(memory_order_relaxed);
+    }
+
+    // audio side, once a block: the threads to split the block's work across; 1 while backing off
+    int threadsForRun() {
+        if (mBackoff > 0) {
+            mBackoff--;
+            return 1;
+        }
+        return activeThreads();
+    }
+
+    //
+    // audio side: runs tasks 0 to numTasks - 1 across the active threads, returning once all are done.
+    // Waiting longer than maxWait seconds for the workers starts a backoff
+    //
+    void run(taskFunction function, void* context, int numTasks, double maxWait);
+
+protected:
+    void workerLoop(int thread);
+    void runTasks(int thread, uint32_t generation);
+
+    // the batch: generation in the top 32 bits, task count in the next 16 and the next unclaimed task in the low 16.
+    // A thread only runs a task after claiming it with a compare-and-swap that also checks the generation,
+    // so a worker that wakes up late can never take a task from a batch it did not see published
+    atomic<uint64_t> mBatch{ 0 };
+    atomic<int> mDone{ 0 };
+    taskFunction mFunction = nullptr;   // written before the batch is published, read after claiming a task
+    void* mContext = nullptr;
+    uint32_t mGeneration = 0;
+    int mBackoff = 0;                   // runs left to the audio thread alone
+
+    atomic<int> mActiveThreads{ 1 };
+    atomic<int> mAwakeThreads{ 1 };     // changed under mWakeMutex, so a worker going to sleep cannot miss it
+    atomic<bool> mRunning{ false };
+    mutex mWakeMutex;
+    condition_variable mWakeCondition;
+    vector<thread> mThreads;
+};
+
+#endif
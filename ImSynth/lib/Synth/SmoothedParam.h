@@ -0,0 +1,124 @@
+//
+//  SmoothedParam.h
+//
+//  A parameter that glides to each new value instead of stepping to it
+//  mid-buffer, so that slider moves do not zipper. The glide is a straight
+//  line set up once per change rather than a filter run sample by sample:
+//  a block only needs where the line starts, its step per frame and how many
+//  of its frames are still on it, and a parameter that only changes at
+//  control rate (detune) just takes the value the block ends on. Once the
+//  target is reached the ramp costs nothing.
+//
+//  Uses the SIMD switch from WaveTableOscPoly.h, which includes this.
+//
+
+#ifndef SmoothedParam_h
+#define SmoothedParam_h
+
+#ifndef useSIMDKernel
+#error "include WaveTableOscPoly.h rather than SmoothedParam.h"
+#endif
+
+#include <algorithm>
+
+using namespace std;
+
+#define smoothingTime (0.02)    // seconds a change takes to glide through
+#define smoothingFrames ((int)(smoothingTime * sampleRate))
+
+class SmoothedParam {
+public:
+    SmoothedParam(float value = 0.0f) : mCurrent(value), mTarget(value) {}
+
+    // straight to value, with no glide
+    void reset(float value) {
+        mCurrent = mTarget = value;
+        mStep = 0.0f;
+        mRemaining = 0;
+    }
+
+    // glides from where it is now to target over rampFrames frames
+    void setTarget(float target, int rampFrames) {
+        if (rampFrames <= 0) {
+            reset(target);
+            return;
+        }
+        mTarget = target;
+        mStep = (target - mCurrent) / rampFrames;
+        mRemaining = rampFrames;
+    }
+
+    float current() const {
+        return mCurrent;
+    }
+
+    float target() const {
+        return mTarget;
+    }
+
+    bool isRamping() const {
+        return mRemaining > 0;
+    }
+
+    // per frame, while ramping
+    float step() const {
+        return mStep;
+    }
+
+    // how many of the next frames are still on the ramp; the rest are at target()
+    int rampFrames(int frames) const {
+        return min(frames, mRemaining);
+    }
+
+    // the value the next frames end on, without moving on
+    float valueAfter(int frames) const {
+        return frames >= mRemaining ? mTarget : mCurrent + mStep * frames;
+    }
+
+    // call once a block has been rendered with the ramp
+    void advance(int frames) {
+        mCurrent = valueAfter(frames);
+        mRemaining = max(0, mRemaining - frames);
+    }
+
+    //
+    // ApplyGain: multiplies the next frames of buffer by the parameter: frame n by current() + step() * (n + 1)
+    // while it is on the ramp, and by target() after that. Does not advance
+    //
+    void applyGain(float* buffer, int frames) const {
+        const int ramp = rampFrames(frames);
+        int n = 0;
+#if useSIMDKernel
+        // the gain from the frame number rather than by adding step, so it does not drift
+        const __m128 start = _mm_set1_ps(mCurrent);
+        const __m128 step = _mm_set1_ps(mStep);
+        const __m128 four = _mm_set1_ps(4.0f);
+        __m128 position = _mm_set_ps(4.0f, 3.0f, 2.0f, 1.0f);
+        for (; n + 4 <= ramp; n += 4) {
+            __m128 gain = _mm_add_ps(start, _mm_mul_ps(position, step));
+            _mm_storeu_ps(buffer + n, _mm_mul_ps(_mm_loadu_ps(buffer + n), gain));
+            position = _mm_add_ps(position, four);
+        }
+#endif
+        for (; n < ramp; n++) {
+            buffer[n] *= mCurrent + mStep * (n + 1);
+        }
+#if useSIMDKernel
+        const __m128 gain = _mm_set1_ps(mTarget);
+        for (; n + 4 <= frames; n += 4) {
+            _mm_storeu_ps(buffer + n, _mm_mul_ps(_mm_loadu_ps(buffer + n), gain));
+        }
+#endif
+        for (; n < frames; n++) {
+            buffer[n] *= mTarget;
+        }
+    }
+
+protected:
+    float mCurrent;
+    float mTarget;
+    float mStep = 0.0f;     // per frame
+    int mRemaining = 0;     // frames of glide left
+};
+
+#endif
@@ -0,0 +1,186 @@
+//
+//  SpectrumAnalyzer.h
+//
+//  Spectrum and spectrogram of an AudioTap, computed on a thread of its own so
+//  the FFTs cost neither the audio callback nor the GUI frame anything. The
+//  thread takes Hann windowed frames of spectrumFftSize samples every
+//  spectrumFftSize / spectrumOverlap samples, and hands each result to the GUI
+//  through a TripleBuffer.
+//
+
+#ifndef SpectrumAnalyzer_h
+#define SpectrumAnalyzer_h
+
+#include <atomic>
+#include <thread>
+#include <chrono>
+#include <vector>
+#include <algorithm>
+#include <math.h>
+
+#include "WaveTable.h"
+#include "AudioTap.h"
+#include "TripleBuffer.h"
+
+using namespace std;
+
+#define spectrumFftSize (4096)
+#define spectrumOverlap (4)         // frames overlap by 3/4
+#define spectrumBins (spectrumFftSize / 2 + 1)
+#define spectrumFloor (-120.0f)     // dB
+#define spectrumSmoothing (0.5f)    // weight of the previous frames in the displayed spectrum
+#define spectrogramRows (128)       // frames of history
+#define spectrogramColumns (256)    // each the loudest of spectrumFftSize / 2 / spectrogramColumns bins
+
+struct spectrumFrame {
+    vector<float> magnitude;        // dB per bin, 0 dB being a full scale sine, smoothed over frames
+    vector<float> spectrogram;      // spectrogramRows x spectrogramColumns of dB, newest row first
+    uint64_t frame = 0;             // frames analysed so far
+};
+
+template <size_t capacity>
+class SpectrumAnalyzer {
+public:
+    SpectrumAnalyzer(const AudioTap<capacity>& tap) : mTap(tap) {
+        mSamples.resize(spectrumFftSize);
+        mWindow.resize(spectrumFftSize);
+        mRe.resize(spectrumFftSize);
+        mIm.resize(spectrumFftSize);
+        mPower.assign(spectrumBins, 0.0f);
+        mFramePower.assign(spectrumBins, 0.0f);
+        mHistory.assign(spectrogramRows * spectrogramColumns, spectrumFloor);
+        for (int n = 0; n < spectrumFftSize; n++) {
+            mWindow[n] = 0.5 - 0.5 * cos(2.0 * M_PI * n / spectrumFftSize);
+        }
+        for (int b = 0; b < 3; b++) {
+            mFrames.buffer(b).magnitude.assign(spectrumBins, spectrumFloor);
+            mFrames.buffer(b).spectrogram.assign(spectrogramRows * spectrogramColumns, spectrumFloor);
+        }
+    }
+
+    ~SpectrumAnalyzer() {
+        stop();
+    }
+
+    SpectrumAnalyzer(const SpectrumAnalyzer&) = delete;
+    SpectrumAnalyzer& operator=(const SpectrumAnalyzer&) = delete;
+
+    void start() {
+        stop();
+        mRunning.store(true);
+        mThread = thread(&SpectrumAnalyzer::threadLoop, this);
+    }
+
+    void stop() {
+        mRunning.store(false);
+        if (mThread.joinable()) {
+            mThread.join();
+        }
+    }
+
+    // the thread only analyses while enabled, e.g. while the window is open
+    void setEnabled(bool enabled) {
+        mEnabled.store(enabled, memory_order_relaxed);
+    }
+
+    //
+    // GUI side: the newest analysis, taken by update() (true if it is new since the last call)
+    //
+    bool update() {
+        return mFrames.update();
+    }
+
+    const spectrumFrame& latest() const {
+        return mFrames.front();
+    }
+
+    static float binFrequency(int bin, float sampleRateHz) {
+        return bin * sampleRateHz / spectrumFftSize;
+    }
+
+protected:
+    void threadLoop() {
+        const int hop = spectrumFftSize / spectrumOverlap;
+        uint64_t next = 0;  // where the next frame ends, in tap samples; 0 to start from the newest
+
+        while (mRunning.load(memory_order_relaxed)) {
+            if (!mEnabled.load(memory_order_relaxed)) {
+                next = 0;
+                this_thread::sleep_for(chrono::milliseconds(20));
+                continue;
+            }
+
+            // a thread that has fallen more than a frame behind skips to the present rather than catching up
+            uint64_t written = mTap.written();
+            if (next == 0 || written > next + spectrumFftSize) {
+                next = max(written, (uint64_t)spectrumFftSize);
+            }
+            if (written < next) {
+                this_thread::sleep_for(chrono::milliseconds(5));
+                continue;
+            }
+            if (!mTap.read(&mSamples[0], spectrumFftSize, next)) {
+                next = 0;
+                continue;
+            }
+            analyse();
+            next += hop;
+        }
+    }
+
+    void analyse() {
+        for (int n = 0; n < spectrumFftSize; n++) {
+            mRe[n] = mSamples[n] * mWindow[n];
+            mIm[n] = 0.0;
+        }
+        fft(spectrumFftSize, mRe, mIm);
+
+        // a full scale sine peaks at N / 4 after the Hann window (N / 2 of gain, half of it in each of +f and -f)
+        const double toFullScale = 4.0 / spectrumFftSize;
+        spectrumFrame& frame = mFrames.back();
+        for (int k = 0; k < spectrumBins; k++) {
+            mFramePower[k] = (float)((mRe[k] * mRe[k] + mIm[k] * mIm[k]) * toFullScale * toFullScale);
+            mPower[k] = spectrumSmoothing * mPower[k] + (1.0f - spectrumSmoothing) * mFramePower[k];
+            frame.magnitude[k] = toDecibels(mPower[k]);
+        }
+
+        mNewestRow = (mNewestRow + spectrogramRows - 1) % spectrogramRows;
+        const int binsPerColumn = (spectrumBins - 1) / spectrogramColumns;
+        float* row = &mHistory[mNewestRow * spectrogramColumns];
+        for (int c = 0; c < spectrogramColumns; c++) {
+            const float* bins = &mFramePower[c * binsPerColumn];
+            row[c] = toDecibels(*max_element(bins, bins + binsPerColumn));
+        }
+
+        // the history is a ring; the GUI gets it in order, newest first
+        const int newerRows = spectrogramRows - mNewestRow;
+        copy(mHistory.begin() + mNewestRow * spectrogramColumns, mHistory.end(), frame.spectrogram.begin());
+        copy(mHistory.begin(), mHistory.begin() + mNewestRow * spectrogramColumns, frame.spectrogram.begin() + newerRows * spectrogramColumns);
+
+        frame.frame = ++mFramesAnalysed;
+        mFrames.publish();
+    }
+
+    static float toDecibels(float power) {
+        return max(spectrumFloor, 10.0f * log10f(power + 1e-30f));
+    }
+
+    const AudioTap<capacity>& mTap;
+    TripleBuffer<spectrumFrame> mFrames;
+
+    // the analysis thread's own
+    vector<float> mSamples;
+    vector<myFloat> mWindow;
+    vector<myFloat> mRe, mIm;
+    vector<float> mPower;       // smoothed power per bin
+    vector<float> mFramePower;  // this frame's, for the spectrogram
+    vector<float> mHistory;     // spectrogram rows, a ring with its newest row at mNewestRow
+    int mNewestRow = 0;
+    uint64_t mFramesAnalysed = 0;
+
+    atomic<bool> mRunning{ false };
+    atomic<bool> mEnabled{ true };
+    thread mThread;
+};
+
+#endif
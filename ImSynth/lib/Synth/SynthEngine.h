@@ -0,0 +1,552 @@
+//
+//  SynthEngine.h
+//
+//  State owned by the audio thread, and the command queue through which the
+//  GUI changes it. Nothing here is written by the GUI directly: it queues a
+//  command, and the audio callback applies everything queued at the start of
+//  each block.
+//
+
+#ifndef SynthEngine_h
+#define SynthEngine_h
+
+#include "WaveTableOscPoly.h"
+#include "Modulation.h"
+#include "CommandQueue.h"
+#include "RenderPool.h"
+#include "AudioTap.h"
+
+enum synthCommandType {
+    cmdNoteFreq,            // intValue: note slot, value: normalised frequency (0 releases the note), key (see sendNote)
+    cmdStackCount,          // intValue: number of stacks in use
+    cmdShape,               // stack, intValue: shape index into templateTables
+    cmdVoices,              // stack, intValue: unison voices
+    cmdDetune,              // stack, value: unison detune, 0-100
+    cmdAmplitude,           // stack, value: stack amplitude
+    cmdResetPhases,         // stack
+    cmdRandomisePhases,     // stack
+    cmdMasterAmplitude,     // value: master gain
+    cmdRenderThreads,       // intValue: threads rendering each block, the audio thread included
+    cmdPitchBend,           // value: semitones, every note
+    cmdVibratoRate,         // value: Hz
+    cmdVibratoDepth,        // value: semitones either side
+    cmdSpread,              // stack, value: unison pan spread, 0-100
+    cmdPan,                 // stack, value: -100 (left) to 100 (right)
+    cmdAttack,              // value: seconds, every note
+    cmdDecay,               // value: seconds
+    cmdSustain,             // value: level, 0-1
+    cmdRelease,             // value: seconds
+    cmdFilterMode,          // stack, intValue: filterMode
+    cmdFilterCutoff,        // stack, value: Hz
+    cmdFilterResonance,     // stack, value: 0-1
+    cmdFilterKeyTrack,      // stack, value: 0-1
+    cmdLfoWave,             // intValue: LFO, value: lfoWave
+    cmdLfoRate,             // intValue: LFO, value: Hz
+    cmdModDepth,            // stack, intValue: LFO * numberOfModDestinations + modDestination, value: depth, -1 to 1
+    cmdControlRate,         // intValue: frames between modulation ticks
+};
+
+struct synthCommand {
+    synthCommandType type;
+    int stack;
+    int intValue;
+    double value;
+    int key;
+    uint64_t frame;         // engine frame to apply it at; anything already past means the start of the next block
+    uint32_t order;         // keeps commands for the same frame in the order they were sent
+};
+
+#define commandQueueSize (1024)
+#define maxPendingCommands (4096)   // commands waiting for their frame; past this they apply at once
+
+CommandQueue<synthCommand, commandQueueSize> commandQueue;
+
+// commands whose frame is still to come, as a heap with the earliest on top
+synthCommand pendingCommands[maxPendingCommands];
+int numPendingCommands = 0;
+uint32_t commandOrder = 0;
+
+// audio thread copies of the global controls
+struct engineState {
+    int numberOfOscStacks = 1;
+    SmoothedParam amplitude{ 0.02f };   // master gain
+    float pitchBend = 0.0f;         // target; the bend ramps to it over a block
+    float vibratoRate = 5.0f;
+    float vibratoDepth = 0.0f;
+    float currentBend = 0.0f;       // where the ramp has got to
+    double vibratoPhase = 0.0;      // 0-1
+    uint64_t frame = 0;             // frames rendered so far
+    int slotKey[maxPolyphony];      // key each note slot was last started with, or midiNone
+    uint32_t slotNotes[maxPolyphony];   // notes started in each slot
+
+    engineState() {
+        fill(slotKey, slotKey + maxPolyphony, midiNone);
+        fill(slotNotes, slotNotes + maxPolyphony, 0u);
+    }
+};
+
+engineState engine;
+
+// Note envelopes, and this block's levels for the kernels. A released note sounds until its
+// envelope ends; the slot is then silenced, and slotNotesEnded tells the GUI it is free
+EnvelopeBank envelopes;
+envelopeSegments envelopeBlock;
+atomic<uint32_t> slotNotesEnded[maxPolyphony] = {};    // as engine.slotNotes once each slot's last note has ended
+
+// LFOs and the modulation matrix
+ModulationMatrix modulation;
+
+// a modulation tick for one stack: amplitude glides to its value at the next tick, frames on; the rest step.
+// The shape swaps tables, so it steps through the shapes as the offset crosses each one
+static void modulateStack(int stack, const stackModulation& mod, int frames)
+{
+    WaveTableOscStack& osc = oscStacks[stack];
+    osc.setModulation(max(0.0f, 1.0f + mod.offset[modAmplitude]), mod.offset[modDetune], mod.offset[modPan], mod.offset[modCutoff], frames);
+    const int shape = max(0, min(osc.shape + (int)lroundf(mod.offset[modShape]), numberOfShapes - 1));
+    if (osc.getTables() != templateTables[shape].get()) {
+        osc.setAllTables(templateTables[shape]);
+    }
+}
+
+bool soundOn = true;
+
+// set by renderBlock while any stack is sounding, for the GUI to pace its redraws by
+atomic<bool> engineSounding{ false };
+
+// engine.frame as at the end of the last block, for other threads to schedule against
+atomic<uint64_t> engineFrame{ 0 };
+
+// Mono mix of the master output, written by renderBlock, for the oscilloscope
+#define outputTapSize (1 << 16)     // samples, about 1.5 seconds
+
+AudioTap<outputTapSize> outputTap;
+vector<float> tapBuffer(maxBlockSize, 0.0f);
+
+// Stereo mix bus for one block, shared by every stack
+vector<float> mixLeft(maxBlockSize, 0.0f);
+vector<float> mixRight(maxBlockSize, 0.0f);
+
+// Pitch ratio for every frame of the block, applied to every note of every stack
+vector<float> pitchBuffer(maxBlockSize, 1.0f);
+
+//
+// Multi-threaded rendering: each stack's note voices (every unison voice of every note) are
+// cut into tasks of up to noteVoicesPerTask. Each thread sums its tasks into its own stereo
+// buffer, and the audio thread adds those into the mix once every task is done, so the
+// threads never write to the same memory.
+//
+#define noteVoicesPerTask (8 * noteLanes)
+#define parallelMinVoices (64)  // fewer note voices than this are rendered on the audio thread alone
+#define parallelMaxWait (0.25)  // of a block's duration, the longest the audio thread waits on the workers
+#define maxRenderTasks (maxOscStacks * ((maxVoices * maxPolyphony + noteVoicesPerTask - 1) / noteVoicesPerTask))
+
+RenderPool renderPool;
+
+struct renderTask {
+    int stack;
+    int first;
+    int end;
+};
+
+struct renderBatch {
+    renderTask tasks[maxRenderTasks];
+    int numTasks = 0;
+    int frames = 0;
+    const float* pitchRatio = nullptr;
+    const envelopeSegments* envelope = nullptr;
+    uint32_t stamp = 0;     // tells a partial buffer written in this batch from a stale one
+};
+
+renderBatch batch;
+vector<float> partialBuffers(maxRenderThreads * 2 * maxBlockSize, 0.0f);    // left then right, per thread
+// each thread's stamp is written only by that thread, and on a cache line of its own
+struct partialStamp {
+    alignas(64) uint32_t stamp;
+};
+partialStamp partialStamps[maxRenderThreads] = {};
+vector<filterSums> filterScratch(maxRenderThreads);     // per thread, for the stacks' filters
+
+//
+// GUI side: queue a change for the audio thread. Returns false if the queue is full
+//
+bool sendCommand(synthCommandType type, int stack = 0, int intValue = 0, double value = 0.0)
+{
+    synthCommand cmd;
+    cmd.type = type;
+    cmd.stack = stack;
+    cmd.intValue = intValue;
+    cmd.value = value;
+    cmd.key = midiNone;
+    cmd.frame = 0;
+    return commandQueue.push(cmd);
+}
+
+//
+// GUI side: start (frequency > 0) or stop the note in a slot, at engine frame (0 for the next block).
+// A note off with a key only stops the slot if it is still playing that key, so an off scheduled
+// ahead of time cannot cut off a different note that has been given the slot meanwhile
+//
+bool sendNote(int slot, int key, double frequency, uint64_t frame = 0)
+{
+    synthCommand cmd;
+    cmd.type = cmdNoteFreq;
+    cmd.stack = 0;
+    cmd.intValue = slot;
+    cmd.value = frequency;
+    cmd.key = key;
+    cmd.frame = frame;
+    return commandQueue.push(cmd);
+}
+
+// GUI side: how many of the notes started in a slot have ended, release and all (for VoiceAllocator::notesEnded)
+uint32_t notesEnded(int slot)
+{
+    return slotNotesEnded[slot].load(memory_order_acquire);
+}
+
+//
+// audio side
+//
+void applyCommand(const synthCommand& cmd)
+{
+    switch (cmd.type) {
+    case cmdNoteFreq:
+        if (cmd.value == 0.0 && cmd.key != midiNone && engine.slotKey[cmd.intValue] != cmd.key) {
+            break;
+        }
+        if (cmd.value != 0.0) {
+            engine.slotKey[cmd.intValue] = cmd.key;
+            engine.slotNotes[cmd.intValue]++;
+            // every stack follows the notes, so stacks switched back on are already in step
+            for (auto& stack : oscStacks) {
+                stack.setFrequencies(cmd.value, cmd.intValue);
+            }
+            envelopes.noteOn(cmd.intValue);
+        } else {
+            // the note keeps sounding through its release; endNote silences it
+            engine.slotKey[cmd.intValue] = midiNone;
+            envelopes.noteOff(cmd.intValue);
+        }
+        break;
+    case cmdStackCount:
+        engine.numberOfOscStacks = max(1, min(cmd.intValue, maxOscStacks));
+        break;
+    case cmdShape:
+        oscStacks[cmd.stack].shape = cmd.intValue;
+        oscStacks[cmd.stack].setAllTables(templateTables[cmd.intValue]);
+        break;
+    case cmdVoices:
+        oscStacks[cmd.stack].setVoices(cmd.intValue);
+        break;
+    case cmdDetune:
+        oscStacks[cmd.stack].setDetune(cmd.value);
+        break;
+    case cmdAmplitude:
+        oscStacks[cmd.stack].setAmplitude(cmd.value);
+        break;
+    case cmdSpread:
+        oscStacks[cmd.stack].setSpread(cmd.value);
+        break;
+    case cmdPan:
+        oscStacks[cmd.stack].setPan(cmd.value);
+        break;
+    case cmdFilterMode:
+        oscStacks[cmd.stack].setFilterMode(cmd.intValue);
+        break;
+    case cmdFilterCutoff:
+        oscStacks[cmd.stack].setFilterCutoff((float)cmd.value);
+        break;
+    case cmdFilterResonance:
+        oscStacks[cmd.stack].filterResonance = (float)cmd.value;
+        break;
+    case cmdFilterKeyTrack:
+        oscStacks[cmd.stack].filterKeyTrack = (float)cmd.value;
+        break;
+    case cmdResetPhases:
+        oscStacks[cmd.stack].resetAllPhases();
+        break;
+    case cmdRandomisePhases:
+        oscStacks[cmd.stack].randomiseAllPhases();
+        break;
+    case cmdMasterAmplitude:
+        // glides while anything sounds, like the stack amplitudes
+        if (engineSounding.load(memory_order_relaxed)) {
+            engine.amplitude.setTarget((float)cmd.value, smoothingFrames);
+        } else {
+            engine.amplitude.reset((float)cmd.value);
+        }
+        break;
+    case cmdRenderThreads:
+        renderPool.setActiveThreads(cmd.intValue);
+        break;
+    case cmdPitchBend:
+        engine.pitchBend = cmd.value;
+        break;
+    case cmdVibratoRate:
+        engine.vibratoRate = cmd.value;
+        break;
+    case cmdVibratoDepth:
+        engine.vibratoDepth = cmd.value;
+        break;
+    case cmdAttack:
+    case cmdDecay:
+    case cmdSustain:
+    case cmdRelease: {
+        adsrSettings settings = envelopes.getSettings();
+        float& setting = cmd.type == cmdAttack ? settings.attack : cmd.type == cmdDecay ? settings.decay
+            : cmd.type == cmdSustain ? settings.sustain : settings.release;
+        setting = (float)cmd.value;
+        envelopes.setSettings(settings);
+        break;
+    }
+    case cmdLfoWave:
+        modulation.setWave(cmd.intValue, (int)cmd.value);
+        break;
+    case cmdLfoRate:
+        modulation.setRate(cmd.intValue, (float)cmd.value);
+        break;
+    case cmdModDepth:
+        modulation.setDepth(cmd.intValue / numberOfModDestinations, cmd.stack, cmd.intValue % numberOfModDestinations, (float)cmd.value);
+        // the last depth taken off puts every stack back as set, as there are no more ticks to do it
+        if (!modulation.isActive()) {
+            const stackModulation none = {};
+            for (int n = 0; n < maxOscStacks; n++) {
+                modulateStack(n, none, smoothingFrames);
+            }
+        }
+        break;
+    case cmdControlRate:
+        modulation.setInterval(cmd.intValue);
+        break;
+    }
+}
+
+static bool laterCommand(const synthCommand& a, const synthCommand& b)
+{
+    return a.frame > b.frame || (a.frame == b.frame && (int32_t)(a.order - b.order) > 0);
+}
+
+// call at the start of every block: applies what is due, and holds the rest until its frame
+void applyCommands()
+{
+    synthCommand cmd;
+    while (commandQueue.pop(cmd)) {
+        if (cmd.frame <= engine.frame || numPendingCommands == maxPendingCommands) {
+            applyCommand(cmd);
+            continue;
+        }
+        cmd.order = commandOrder++;
+        pendingCommands[numPendingCommands++] = cmd;
+        push_heap(pendingCommands, pendingCommands + numPendingCommands, laterCommand);
+    }
+}
+
+void applyDueCommands()
+{
+    while (numPendingCommands > 0 && pendingCommands[0].frame <= engine.frame) {
+        pop_heap(pendingCommands, pendingCommands + numPendingCommands, laterCommand);
+        applyCommand(pendingCommands[--numPendingCommands]);
+    }
+}
+
+// RenderPool task: adds a range of one stack's note voices into this thread's buffers
+static void renderVoiceTask(void* context, int task, int thread)
+{
+    renderBatch* job = (renderBatch*)context;
+    const renderTask& t = job->tasks[task];
+    float* partialLeft = &partialBuffers[thread * 2 * maxBlockSize];
+    float* partialRight = partialLeft + maxBlockSize;
+
+    if (partialStamps[thread].stamp != job->stamp) {
+        fill(partialLeft, partialLeft + job->frames, 0.0f);
+        fill(partialRight, partialRight + job->frames, 0.0f);
+        partialStamps[thread].stamp = job->stamp;
+    }
+    oscStacks[t.stack].processBlockStereo(partialLeft, partialRight, job->frames, t.first, t.end, job->pitchRatio, job->envelope, &filterScratch[thread]);
+}
+
+// mixes the stacks into mixLeft and mixRight across the render pool; false when the load is too small to be worth it
+bool mixStacksParallel(int frames, const float* pitchRatio, const envelopeSegments* envelope)
+{
+    int threads = renderPool.threadsForRun();
+    if (threads <= 1) {
+        return false;
+    }
+
+    int noteVoices = 0;
+    for (int n = 0; n < engine.numberOfOscStacks; n++) {
+        noteVoices += oscStacks[n].numNoteVoices();
+    }
+    if (noteVoices < parallelMinVoices) {
+        return false;
+    }
+
+    batch.numTasks = 0;
+    batch.frames = frames;
+    batch.pitchRatio = pitchRatio;
+    batch.envelope = envelope;
+    batch.stamp++;
+    for (int n = 0; n < engine.numberOfOscStacks; n++) {
+        int stackVoices = oscStacks[n].numNoteVoices();
+        for (int first = 0; first < stackVoices; first += noteVoicesPerTask) {
+            renderTask& t = batch.tasks[batch.numTasks++];
+            t.stack = n;
+            t.first = first;
+            t.end = min(first + noteVoicesPerTask, stackVoices);
+        }
+    }
+
+    renderPool.run(renderVoiceTask, &batch, batch.numTasks, parallelMaxWait * frames / sampleRate);
+
+    fill(mixLeft.begin(), mixLeft.begin() + frames, 0.0f);
+    fill(mixRight.begin(), mixRight.begin() + frames, 0.0f);
+    for (int thread = 0; thread < maxRenderThreads; thread++) {
+        if (partialStamps[thread].stamp != batch.stamp) {
+            continue;
+        }
+        const float* partialLeft = &partialBuffers[thread * 2 * maxBlockSize];
+        const float* partialRight = partialLeft + maxBlockSize;
+        for (int i = 0; i < frames; i++) {
+            mixLeft[i] += partialLeft[i];
+            mixRight[i] += partialRight[i];
+        }
+    }
+    return true;
+}
+
+// an envelope's release has ended: the note stops rendering, and its slot can be given a new one
+static void endNote(int slot)
+{
+    for (auto& stack : oscStacks) {
+        stack.setFrequencies(0.0, slot);
+    }
+    slotNotesEnded[slot].store(engine.slotNotes[slot], memory_order_release);
+}
+
+// moves every glide, and the modulation ticks, on past frames that have been rendered
+static void advanceSmoothing(int frames)
+{
+    modulation.advance(frames);
+    engine.amplitude.advance(frames);
+    for (auto& stack : oscStacks) {
+        stack.advanceSmoothing(frames);
+    }
+}
+
+// fills pitchBuffer for the next frames of bend and vibrato; nullptr when neither is in use,
+// so the stacks keep to their unmodulated kernels
+const float* renderPitch(int frames)
+{
+    if (engine.currentBend == 0.0f && engine.pitchBend == 0.0f && engine.vibratoDepth == 0.0f) {
+        return nullptr;
+    }
+
+    const double bendStep = (engine.pitchBend - engine.currentBend) / frames;
+    const double phaseStep = engine.vibratoRate / sampleRate;
+    double bend = engine.currentBend;
+    double phase = engine.vibratoPhase;
+    for (int n = 0; n < frames; n++) {
+        bend += bendStep;
+        phase += phaseStep;
+        if (phase >= 1.0)
+            phase -= 1.0;
+        double semitones = bend + engine.vibratoDepth * sin(2.0 * M_PI * phase);
+        pitchBuffer[n] = (float)exp2(semitones / 12.0);
+    }
+    engine.currentBend = engine.pitchBend;
+    engine.vibratoPhase = phase;
+    return &pitchBuffer[0];
+}
+
+//
+// renderFrames: renders framesPerBuffer frames of the stereo master mix into out, interleaved.
+// One channel gets the mono sum; past two, even channels repeat the left and odd channels the right
+//
+static void renderFrames(float* out, unsigned long framesPerBuffer, unsigned int channels)
+{
+    bool idle = true;
+    if (soundOn) {
+        for (int n = 0; n < engine.numberOfOscStacks; n++) {
+            if (!oscStacks[n].isSilent()) {
+                idle = false;
+                break;
+            }
+        }
+    }
+    engineSounding.store(!idle, memory_order_relaxed);
+
+    // nothing is sounding: skip the stacks and the mix loop entirely
+    if (idle) {
+        fill(out, out + framesPerBuffer * channels, 0.0f);
+        fill(tapBuffer.begin(), tapBuffer.end(), 0.0f);
+        for (unsigned long offset = 0; offset < framesPerBuffer;) {
+            int frames = modulation.render((int)min(framesPerBuffer - offset, (unsigned long)maxBlockSize), modulateStack);
+            frames = envelopes.render(frames, envelopeBlock, endNote);
+            outputTap.write(&tapBuffer[0], frames);
+            advanceSmoothing(frames);
+            offset += frames;
+        }
+        return;
+    }
+
+    for (unsigned long offset = 0; offset < framesPerBuffer;) {
+        // cut short at the next modulation tick, and where a note's release ends, so both land on their frames
+        int frames = modulation.render((int)min(framesPerBuffer - offset, (unsigned long)maxBlockSize), modulateStack);
+        frames = envelopes.render(frames, envelopeBlock, endNote);
+
+        const float* pitchRatio = renderPitch(frames);
+        if (!mixStacksParallel(frames, pitchRatio, &envelopeBlock)) {
+            fill(mixLeft.begin(), mixLeft.begin() + frames, 0.0f);
+            fill(mixRight.begin(), mixRight.begin() + frames, 0.0f);
+            for (int n = 0; n < engine.numberOfOscStacks; n++) {
+                oscStacks[n].processBlockStereo(&mixLeft[0], &mixRight[0], frames, 0, oscStacks[n].numNoteVoices(), pitchRatio, &envelopeBlock, &filterScratch[0]);
+            }
+        }
+
+        engine.amplitude.applyGain(&mixLeft[0], frames);
+        engine.amplitude.applyGain(&mixRight[0], frames);
+        advanceSmoothing(frames);
+
+        for (int n = 0; n < frames; n++) {
+            float left = mixLeft[n];
+            float right = mixRight[n];
+
+            tapBuffer[n] = 0.5f * (left + right);
+
+            if (channels == 1) {
+                *out++ = tapBuffer[n];
+                continue;
+            }
+            for (unsigned int channel = 0; channel < channels; channel++) {
+                *out++ = (channel & 1) ? right : left;
+            }
+        }
+        outputTap.write(&tapBuffer[0], frames);
+        offset += frames;
+    }
+}
+
+//
+// renderBlock: applies queued commands, then renders framesPerBuffer frames with renderFrames,
+// split wherever a command is due inside the block so that it lands on its exact frame.
+// Used by the PortAudio callback and by the offline renderer
+//
+void renderBlock(float* out, unsigned long framesPerBuffer, unsigned int channels)
+{
+    applyCommands();
+
+    while (framesPerBuffer > 0) {
+        applyDueCommands();
+        unsigned long frames = framesPerBuffer;
+        if (numPendingCommands > 0) {
+            frames = (unsigned long)min((uint64_t)frames, pendingCommands[0].frame - engine.frame);
+        }
+        renderFrames(out, frames, channels);
+        out += frames * channels;
+        framesPerBuffer -= frames;
+        engine.frame += frames;
+    }
+    engineFrame.store(engine.frame, memory_order_relaxed);
+}
+
+#endif
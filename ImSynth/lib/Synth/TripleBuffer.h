@@ -0,0 +1,62 @@
+//
+//  TripleBuffer.h
+//
+//  Lock-free hand-over of a whole value from one thread to another. The
+//  writer fills the back buffer and publishes it; the reader takes the most
+//  recently published one. Each side only ever touches its own buffer, and
+//  they swap through a third, so neither waits and the reader never sees a
+//  half-written value. Values the reader was too slow for are simply skipped.
+//
+
+#ifndef TripleBuffer_h
+#define TripleBuffer_h
+
+#include <atomic>
+
+using namespace std;
+
+template <typename T>
+class TripleBuffer {
+public:
+    // either side, before the other thread starts: to size the three buffers alike
+    T& buffer(int n) {
+        return mBuffers[n];
+    }
+
+    //
+    // Writer side: fill back(), then publish() it
+    //
+    T& back() {
+        return mBuffers[mBack];
+    }
+
+    void publish() {
+        mBack = mMiddle.exchange(mBack | freshBit, memory_order_acq_rel) & indexMask;
+    }
+
+    //
+    // Reader side: update() takes the latest published buffer, if there is a new one, as front()
+    //
+    bool update() {
+        if ((mMiddle.load(memory_order_relaxed) & freshBit) == 0) {
+            return false;
+        }
+        mFront = mMiddle.exchange(mFront, memory_order_acq_rel) & indexMask;
+        return true;
+    }
+
+    const T& front() const {
+        return mBuffers[mFront];
+    }
+
+protected:
+    static const int indexMask = 3;
+    static const int freshBit = 4;  // set in mMiddle while it holds a buffer the reader has not taken
+
+    T mBuffers[3];
+    int mBack = 0;      // writer's
+    int mFront = 1;     // reader's
+    alignas(64) atomic<int> mMiddle{ 2 };
+};
+
+#endif
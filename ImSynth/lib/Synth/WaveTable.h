@@ -0,0 +1,96 @@
+//
+//  WaveTable.h
+//
+//  Wavetable generation settings, and the banks the oscillators play from.
+//  The table builder in WaveTableOsc.cpp and the polyphonic oscillator share
+//  these definitions.
+//
+
+#ifndef WaveTable_h
+#define WaveTable_h
+
+#include <vector>
+#include <memory>
+#include <math.h>
+#include <stdint.h>
+#include <string.h>
+
+using namespace std;
+
+#ifndef M_PI
+#define M_PI  (3.14159265)
+#endif
+
+//
+// some things to tweak for testing and experimenting
+//
+#define sampleRate (44100)
+
+// oscillator
+#define overSamp (2)        /* oversampling factor (positive integer) */
+#define baseFrequency (20)  /* starting frequency of first table */
+#define constantRatioLimit (256)    /* minimum table length: set to a large number (greater than or equal to the length of the lowest octave table) for constant table size; set to 0 for a constant oversampling ratio (each higher ocatave table length reduced by half); set somewhere between (64, for instance) for constant oversampling but with a minimum limit */
+
+#define myFloat double      /* float or double, to set the resolution of the FFT, etc. (the resulting wavetables are always float) */
+
+#define numberOfShapes (4) // total number of wave shapes implemented
+
+// a single table as it comes out of makeWaveTable
+struct waveTable {
+    double topFreq;
+    int waveTableLen;
+    vector<float> waveTable_;
+};
+
+// one octave level of a bank
+struct waveTableLevel {
+    double topFreq;         // highest normalised frequency the level is used for
+    int waveTableLen;       // length without the guard sample
+    const float* samples;   // waveTableLen + 1 samples in the bank's storage, the last repeating the first
+};
+
+// every level of one shape, lowest first, in a single block of samples.
+// A bank is never modified once built, so any number of oscillators can play from it at once.
+struct waveTableBank {
+    vector<waveTableLevel> levels;
+    vector<float> storage;  // empty when the levels point into a mapped cache file (WaveTableCache.h)
+    double invFirstTopFreq = 0.0;   // 1 / levels[0].topFreq, for levelForIncrement
+};
+
+typedef shared_ptr<const waveTableBank> sharedWaveTableBank;
+
+//
+// levelForIncrement: the level to play a phase increment from, without searching.
+// Each level's topFreq is double the one below, so the level is the number of octaves
+// the increment is above levels[0].topFreq, which is the binary exponent of their ratio.
+// Gives the same level as scanning up while inc >= topFreq, and is cheap enough to call every sample
+//
+inline int levelForIncrement(const waveTableBank* bank, double inc) {
+    double ratio = inc * bank->invFirstTopFreq;
+    uint64_t bits;
+    memcpy(&bits, &ratio, sizeof(bits));
+    int exponent = (int)((bits >> 52) & 0x7ff) - 1022;  // as frexp: ratio = m * 2^exponent, 0.5 <= m < 1
+    int lastLevel = (int)bank->levels.size() - 1;
+    return exponent < 0 ? 0 : (exponent > lastLevel ? lastLevel : exponent);
+}
+
+// e^(i*2*pi*k/N) for k < N/2, shared by every transform of length N, or of N / 2^j with a stride
+struct fftTwiddles {
+    int N = 0;
+    vector<myFloat> re;
+    vector<myFloat> im;
+};
+
+void fft(int N, vector<myFloat>& ar, vector<myFloat>& ai);
+fftTwiddles makeTwiddles(int N);
+void realSpectrumToWave(int N, const vector<myFloat>& ar, vector<myFloat>& out, const fftTwiddles& twiddles);
+void defineSine(int len, vector<myFloat>& ar, vector<myFloat>& ai);
+void defineTriangle(int len, int numHarmonics, vector<myFloat>& ar, vector<myFloat>& ai);
+void defineSawtooth(int len, int numHarmonics, vector<myFloat>& ar, vector<myFloat>& ai);
+void defineSquare(int len, int numHarmonics, vector<myFloat>& ar, vector<myFloat>& ai);
+
+void makeAllTables(vector<sharedWaveTableBank>* allBanks, float baseFreq);
+waveTable makeWaveTable(int len, vector<myFloat>& ar, vector<myFloat>& ai, double topFreq, const fftTwiddles* twiddles = NULL);
+sharedWaveTableBank makeWaveTableBank(const vector<waveTable>& tables);
+
+#endif
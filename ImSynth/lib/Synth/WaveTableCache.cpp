@@ -0,0 +1,277 @@
+//
+//  WaveTableCache.cpp
+//
+//  File layout, all little-endian:
+//      tableCacheHeader
+//      numberOfShapes x tableCacheShape
+//      tableCacheLevel for every level of every shape, shape by shape
+//      samples: each level's waveTableLen + 1 floats, starting on a 64 byte boundary
+//
+
+#include <stdio.h>
+#include <stdint.h>
+#include <string.h>
+#include <string>
+
+#ifdef _WIN32
+#define WIN32_LEAN_AND_MEAN
+#define NOMINMAX
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+#include "WaveTableCache.h"
+
+using namespace std;
+
+struct tableCacheHeader {
+    char magic[8];          // "ImSynWT\0"
+    uint32_t version;
+    uint32_t headerSize;    // sizeof(tableCacheHeader), catches a layout change without a version bump
+    uint32_t sampleRateHz;
+    uint32_t overSampling;
+    uint32_t minTableLen;   // constantRatioLimit
+    uint32_t reserved;
+    double baseFreq;
+    uint32_t shapes;
+    uint32_t totalLevels;
+    uint64_t samplesOffset; // bytes from the start of the file
+    uint64_t samplesCount;  // floats
+};
+
+struct tableCacheShape {
+    uint32_t firstLevel;
+    uint32_t levelCount;
+};
+
+struct tableCacheLevel {
+    double topFreq;
+    uint32_t waveTableLen;
+    uint32_t reserved;
+    uint64_t sampleOffset;  // floats from the start of the samples
+};
+
+static const char tableCacheMagic[8] = { 'I', 'm', 'S', 'y', 'n', 'W', 'T', '\0' };
+
+// a read-only view of the whole file, unmapped when the last bank using it goes
+class tableCacheMapping {
+public:
+    ~tableCacheMapping() {
+#ifdef _WIN32
+        if (data != NULL) UnmapViewOfFile(data);
+        if (mapping != NULL) CloseHandle(mapping);
+        if (file != INVALID_HANDLE_VALUE) CloseHandle(file);
+#else
+        if (data != NULL) munmap((void*)data, size);
+#endif
+    }
+
+    bool open(const char* path) {
+#ifdef _WIN32
+        file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_DELETE, NULL, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+        if (file == INVALID_HANDLE_VALUE) {
+            return false;
+        }
+        LARGE_INTEGER fileSize;
+        if (!GetFileSizeEx(file, &fileSize) || fileSize.QuadPart == 0) {
+            return false;
+        }
+        size = (size_t)fileSize.QuadPart;
+        mapping = CreateFileMappingA(file, NULL, PAGE_READONLY, 0, 0, NULL);
+        if (mapping == NULL) {
+            return false;
+        }
+        data = (const char*)MapViewOfFile(mapping, FILE_MAP_READ, 0, 0, 0);
+        return data != NULL;
+#else
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat st;
+        if (fstat(fd, &st) != 0 || st.st_size == 0) {
+            ::close(fd);
+            return false;
+        }
+        size = (size_t)st.st_size;
+        void* mapped = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+        ::close(fd);    // the mapping keeps the file
+        if (mapped == MAP_FAILED) {
+            return false;
+        }
+        data = (const char*)mapped;
+        return true;
+#endif
+    }
+
+    const char* data = NULL;
+    size_t size = 0;
+
+private:
+#ifdef _WIN32
+    HANDLE file = INVALID_HANDLE_VALUE;
+    HANDLE mapping = NULL;
+#endif
+};
+
+// a bank whose levels point into a mapping, holding the mapping open
+struct mappedWaveTableBank {
+    shared_ptr<tableCacheMapping> mapping;
+    waveTableBank bank;
+};
+
+static bool headerMatches(const tableCacheHeader& header, float baseFreq) {
+    return memcmp(header.magic, tableCacheMagic, sizeof(tableCacheMagic)) == 0
+        && header.version == tableCacheVersion
+        && header.headerSize == sizeof(tableCacheHeader)
+        && header.sampleRateHz == sampleRate
+        && header.overSampling == overSamp
+        && header.minTableLen == constantRatioLimit
+        && header.baseFreq == (double)baseFreq
+        && header.shapes == numberOfShapes;
+}
+
+bool loadTableCache(const char* path, vector<sharedWaveTableBank>* allBanks, float baseFreq) {
+    auto mapping = make_shared<tableCacheMapping>();
+    if (!mapping->open(path) || mapping->size < sizeof(tableCacheHeader)) {
+        return false;
+    }
+
+    tableCacheHeader header;
+    memcpy(&header, mapping->data, sizeof(header));
+    if (!headerMatches(header, baseFreq)) {
+        return false;
+    }
+
+    // everything is bounds checked, so a truncated or corrupt file is a miss rather than a crash
+    size_t tablesEnd = sizeof(header) + header.shapes * sizeof(tableCacheShape) + (size_t)header.totalLevels * sizeof(tableCacheLevel);
+    if (tablesEnd > mapping->size || header.samplesOffset < tablesEnd || header.samplesOffset % 64 != 0
+        || header.samplesCount > (mapping->size - header.samplesOffset) / sizeof(float)) {
+        return false;
+    }
+    const tableCacheShape* shapes = (const tableCacheShape*)(mapping->data + sizeof(header));
+    const tableCacheLevel* levels = (const tableCacheLevel*)(shapes + header.shapes);
+    const float* samples = (const float*)(mapping->data + header.samplesOffset);
+
+    vector<sharedWaveTableBank> banks(numberOfShapes);
+    for (int n = 0; n < numberOfShapes; n++) {
+        const tableCacheShape& shape = shapes[n];
+        if (shape.levelCount == 0 || shape.firstLevel > header.totalLevels || shape.levelCount > header.totalLevels - shape.firstLevel) {
+            return false;
+        }
+        auto mapped = make_shared<mappedWaveTableBank>();
+        mapped->mapping = mapping;
+        for (uint32_t l = 0; l < shape.levelCount; l++) {
+            const tableCacheLevel& stored = levels[shape.firstLevel + l];
+            if (stored.waveTableLen == 0 || stored.sampleOffset > header.samplesCount
+                || stored.waveTableLen + 1 > header.samplesCount - stored.sampleOffset) {
+                return false;
+            }
+            waveTableLevel level;
+            level.topFreq = stored.topFreq;
+            level.waveTableLen = stored.waveTableLen;
+            level.samples = samples + stored.sampleOffset;
+            mapped->bank.levels.push_back(level);
+        }
+        mapped->bank.invFirstTopFreq = 1.0 / mapped->bank.levels[0].topFreq;
+        // aliasing constructor: the bank lives as long as its holder, and with it the mapping
+        banks[n] = sharedWaveTableBank(mapped, &mapped->bank);
+    }
+
+    *allBanks = banks;
+    return true;
+}
+
+static bool writeAll(FILE* file, const void* data, size_t bytes) {
+    return bytes == 0 || fwrite(data, 1, bytes, file) == bytes;
+}
+
+bool saveTableCache(const char* path, const vector<sharedWaveTableBank>& allBanks, float baseFreq) {
+    if (allBanks.size() != numberOfShapes) {
+        return false;
+    }
+
+    tableCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, tableCacheMagic, sizeof(tableCacheMagic));
+    header.version = tableCacheVersion;
+    header.headerSize = sizeof(tableCacheHeader);
+    header.sampleRateHz = sampleRate;
+    header.overSampling = overSamp;
+    header.minTableLen = constantRatioLimit;
+    header.baseFreq = baseFreq;
+    header.shapes = numberOfShapes;
+
+    vector<tableCacheShape> shapes(numberOfShapes);
+    vector<tableCacheLevel> levels;
+    uint64_t samplesCount = 0;
+    for (int n = 0; n < numberOfShapes; n++) {
+        shapes[n].firstLevel = (uint32_t)levels.size();
+        shapes[n].levelCount = (uint32_t)allBanks[n]->levels.size();
+        for (const auto& level : allBanks[n]->levels) {
+            tableCacheLevel stored;
+            memset(&stored, 0, sizeof(stored));
+            stored.topFreq = level.topFreq;
+            stored.waveTableLen = level.waveTableLen;
+            stored.sampleOffset = samplesCount;
+            levels.push_back(stored);
+            samplesCount += level.waveTableLen + 1;
+        }
+    }
+    header.totalLevels = (uint32_t)levels.size();
+    header.samplesCount = samplesCount;
+    size_t tablesEnd = sizeof(header) + shapes.size() * sizeof(tableCacheShape) + levels.size() * sizeof(tableCacheLevel);
+    header.samplesOffset = (tablesEnd + 63) & ~(uint64_t)63;
+
+    // named for this process, so two starting together never write the same temp file
+#ifdef _WIN32
+    string tempPath = string(path) + "." + to_string(GetCurrentProcessId()) + ".tmp";
+#else
+    string tempPath = string(path) + "." + to_string(getpid()) + ".tmp";
+#endif
+    FILE* file = fopen(tempPath.c_str(), "wb");
+    if (file == NULL) {
+        return false;
+    }
+    static const char padding[64] = {};
+    bool ok = writeAll(file, &header, sizeof(header))
+        && writeAll(file, shapes.data(), shapes.size() * sizeof(tableCacheShape))
+        && writeAll(file, levels.data(), levels.size() * sizeof(tableCacheLevel))
+        && writeAll(file, padding, header.samplesOffset - tablesEnd);
+    for (int n = 0; ok && n < numberOfShapes; n++) {
+        for (const auto& level : allBanks[n]->levels) {
+            ok = ok && writeAll(file, level.samples, (level.waveTableLen + 1) * sizeof(float));
+        }
+    }
+    ok = (fclose(file) == 0) && ok;
+
+    // another process may have written the same cache meanwhile; either copy is as good
+#ifdef _WIN32
+    ok = ok && MoveFileExA(tempPath.c_str(), path, MOVEFILE_REPLACE_EXISTING);
+#else
+    ok = ok && rename(tempPath.c_str(), path) == 0;
+#endif
+    if (!ok) {
+        remove(tempPath.c_str());
+    }
+    return ok;
+}
+
+void loadOrMakeAllTables(vector<sharedWaveTableBank>* allBanks, float baseFreq, const char* path) {
+    if (loadTableCache(path, allBanks, baseFreq)) {
+        return;
+    }
+
+    makeAllTables(allBanks, baseFreq);
+    if (!saveTableCache(path, *allBanks, baseFreq)) {
+        fprintf(stderr, "Warning: cannot write wavetable cache %s\n", path);
+        return;
+    }
+
+    // play from the mapping too, so this process shares pages with the ones that start after it
+    loadTableCache(path, allBanks, baseFreq);
+}
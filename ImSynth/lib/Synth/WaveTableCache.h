@@ -0,0 +1,27 @@
+//
+//  WaveTableCache.h
+//
+//  On-disk cache of the wavetable banks. The first start writes every shape's
+//  levels to one file; later starts map that file read-only and the banks'
+//  level pointers point straight into the mapping, so nothing is generated or
+//  copied, and every process on the host plays from the same physical pages.
+//
+
+#ifndef WaveTableCache_h
+#define WaveTableCache_h
+
+#include "WaveTable.h"
+
+#define tableCacheVersion (2)   // bump whenever the table generation or file layout changes
+#define defaultTableCachePath "ImSynth_wavetables.bin"
+
+// maps the cache, if it exists and was built for this version, sampleRate, overSamp, constantRatioLimit, baseFreq and numberOfShapes
+bool loadTableCache(const char* path, vector<sharedWaveTableBank>* allBanks, float baseFreq);
+
+// writes to a temporary file renamed into place, so a concurrent reader never sees a partial cache
+bool saveTableCache(const char* path, const vector<sharedWaveTableBank>& allBanks, float baseFreq);
+
+// loadTableCache, or makeAllTables and then saveTableCache (and map what was written) on a miss
+void loadOrMakeAllTables(vector<sharedWaveTableBank>* allBanks, float baseFreq, const char* path = defaultTableCachePath);
+
+#endif
@@ -18,63 +18,155 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <atomic>
+#include <thread>
 #include <math.h>
 
 using namespace std;
 
-#include "WaveTableOsc.h"
+#include "WaveTable.h"
 
-void makeAllTables(vector<vector<waveTable>>* allTables, float baseFreq) {
-    // run loop over every wavetable shape
+// one table to build: a shape at one octave level
+struct tableJob {
+    int shape;
+    int level;
+    int tableLen;
+    int numHarmonics;
+    double topFreq;
+};
+
+static void buildTable(const tableJob& job, const fftTwiddles& twiddles, waveTable& table) {
+    vector<myFloat> ar(job.tableLen), ai(job.tableLen); // for ifft
+
+    if (job.shape == 0) {
+        defineSine(job.tableLen, ar, ai);
+    }
+    else if (job.shape == 1) {
+        defineTriangle(job.tableLen, job.numHarmonics, ar, ai);
+    }
+    else if (job.shape == 2) {
+        defineSawtooth(job.tableLen, job.numHarmonics, ar, ai);
+    }
+    else if (job.shape == 3) {
+        defineSquare(job.tableLen, job.numHarmonics, ar, ai);
+    }
+    table = makeWaveTable(job.tableLen, ar, ai, job.topFreq, &twiddles);
+}
+
+void makeAllTables(vector<sharedWaveTableBank>* allBanks, float baseFreq) {
+    // calc number of harmonics where the highest harmonic baseFreq and lowest alias an octave higher would meet
+    int firstHarms = sampleRate / (3.0 * baseFreq) + 0.5;
+
+    // round up to nearest power of two
+    unsigned int v = firstHarms;
+    v--;            // so we don't go up if already a power of 2
+    v |= v >> 1;    // roll the highest bit into all lower bits...
+    v |= v >> 2;
+    v |= v >> 4;
+    v |= v >> 8;
+    v |= v >> 16;
+    v++;            // and increment to power of 2
+    int tableLen = v * 2 * overSamp;  // double for the sample rate, then oversampling
+
+    // list every shape and octave level up front, so they can be built in any order
+    vector<tableJob> jobs;
+    vector<int> levelsPerShape(numberOfShapes, 0);
     for (int n = 0; n < numberOfShapes; n++) {
-        // calc number of harmonics where the highest harmonic baseFreq and lowest alias an octave higher would meet
-        int maxHarms = sampleRate / (3.0 * baseFreq) + 0.5;
-
-        // round up to nearest power of two
-        unsigned int v = maxHarms;
-        v--;            // so we don't go up if already a power of 2
-        v |= v >> 1;    // roll the highest bit into all lower bits...
-        v |= v >> 2;
-        v |= v >> 4;
-        v |= v >> 8;
-        v |= v >> 16;
-        v++;            // and increment to power of 2
-        int tableLen = v * 2 * overSamp;  // double for the sample rate, then oversampling
-
-        vector<myFloat> ar(tableLen), ai(tableLen); // for ifft
         double topFreq = baseFreq * 2.0 / sampleRate;
-
-        for (; maxHarms >= 1; maxHarms >>= 1) {
-            if (n == 0) {
-                defineSine(tableLen, ar, ai);
-            }
-            else if (n == 1) {
-                defineTriangle(tableLen, maxHarms, ar, ai);
-            }
-            else if (n == 2) {
-                defineSawtooth(tableLen, maxHarms, ar, ai);
-            }
-            else if (n == 3) {
-                defineSquare(tableLen, maxHarms, ar, ai);
-            }
-            waveTable table = makeWaveTable(tableLen, ar, ai, topFreq);
-            (*allTables)[n].push_back(table);
+        int levelLen = tableLen;
+        int level = 0;
+        for (int maxHarms = firstHarms; maxHarms >= 1; maxHarms >>= 1) {
+            tableJob job = { n, level++, levelLen, maxHarms, topFreq };
+            jobs.push_back(job);
             topFreq *= 2;
-            //if (tableLen > constantRatioLimit) // variable table size (constant oversampling but with minimum table size)
-            //    tableLen >>= 1;
+            // variable table size: each octave up has half the harmonics, so half the length keeps the
+            // oversampling the same; constantRatioLimit is the shortest a table gets
+            if (levelLen / 2 >= max(constantRatioLimit, 4))
+                levelLen >>= 1;
         }
+        levelsPerShape[n] = level;
+    }
+
+    // twiddles are shared read-only by the workers; the first (longest) table's serve every length
+    fftTwiddles twiddles = makeTwiddles(tableLen);
+
+    // build the tables on every core, each worker taking the next job until none are left
+    vector<waveTable> built(jobs.size());
+    atomic<size_t> nextJob{ 0 };
+    auto worker = [&]() {
+        for (size_t j = nextJob++; j < jobs.size(); j = nextJob++) {
+            buildTable(jobs[j], twiddles, built[j]);
+        }
+    };
+
+    unsigned int numThreads = max(1u, min(thread::hardware_concurrency(), (unsigned int)jobs.size()));
+    vector<thread> threads;
+    for (unsigned int t = 1; t < numThreads; t++) {
+        threads.emplace_back(worker);
+    }
+    worker();
+    for (auto& t : threads) {
+        t.join();
+    }
+
+    size_t first = 0;
+    for (int n = 0; n < numberOfShapes; n++) {
+        vector<waveTable> tables(built.begin() + first, built.begin() + first + levelsPerShape[n]);
+        (*allBanks)[n] = makeWaveTableBank(tables);
+        first += levelsPerShape[n];
     }
 }
 
+//
+// packs a shape's tables, lowest first, into one block of samples
+//
+sharedWaveTableBank makeWaveTableBank(const vector<waveTable>& tables)
+{
+    shared_ptr<waveTableBank> bank = make_shared<waveTableBank>();
+
+    size_t totalLen = 0;
+    for (const auto& table : tables) {
+        totalLen += table.waveTable_.size();
+    }
+    bank->storage.reserve(totalLen);
+
+    for (const auto& table : tables) {
+        bank->storage.insert(bank->storage.end(), table.waveTable_.begin(), table.waveTable_.end());
+    }
+
+    // pointers are taken only once storage has stopped growing
+    size_t offset = 0;
+    for (const auto& table : tables) {
+        waveTableLevel level;
+        level.topFreq = table.topFreq;
+        level.waveTableLen = table.waveTableLen;
+        level.samples = bank->storage.data() + offset;
+        bank->levels.push_back(level);
+        offset += table.waveTable_.size();
+    }
+    bank->invFirstTopFreq = 1.0 / bank->levels[0].topFreq;
+
+    return bank;
+}
+
 //
 // if scale is 0, auto-scales
 // returns scaling factor (0.0 if failure), and wavetable in ai array
 //
-waveTable makeWaveTable(int len, vector<myFloat>& ar, vector<myFloat>& ai, double topFreq)
+// twiddles can be for a longer length than len, len times a power of two, and are then read with a
+// stride, so the longest table's serve every shorter one; they are computed here if not given or unusable
+//
+waveTable makeWaveTable(int len, vector<myFloat>& ar, vector<myFloat>& ai, double topFreq, const fftTwiddles* twiddles)
 {
     waveTable table;
 
-    fft(len, ar, ai);
+    // the spectrum is real, so only the imaginary part of the full complex fft was ever used
+    if (twiddles != NULL && twiddles->N >= len && twiddles->N % len == 0) {
+        realSpectrumToWave(len, ar, ai, *twiddles);
+    } else {
+        realSpectrumToWave(len, ar, ai, makeTwiddles(len));
+    }
 
     myFloat max = 0.0;
     float scale = 0.0;
@@ -181,6 +273,103 @@ void fft(int N, vector<myFloat>& ar, vector<myFloat>& ai)
     }
 }
 
+//
+// makeTwiddles
+//
+// e^(i*2*pi*k/N) for k < N/2, computed directly rather than by recurrence
+//
+fftTwiddles makeTwiddles(int N)
+{
+    fftTwiddles twiddles;
+    twiddles.N = N;
+    twiddles.re.resize(N / 2);
+    twiddles.im.resize(N / 2);
+    for (int k = 0; k < N / 2; k++) {
+        twiddles.re[k] = cos(2.0 * M_PI * k / N);
+        twiddles.im[k] = sin(2.0 * M_PI * k / N);
+    }
+    return twiddles;
+}
+
+//
+// realSpectrumToWave
+//
+// For a spectrum ar with no imaginary part, returns in out exactly what fft() leaves in ai,
+//     out[n] = -sum over k of ar[k] * sin(2*pi*k*n/N)
+// i.e. a sum of sines. That is the inverse transform of the Hermitian spectrum
+// H[k] = -i*b[k]/2, with b[k] = -(ar[k] - ar[N-k]), whose output is real, so it is done
+// as one complex inverse fft of half the size, packing even samples in the real part and
+// odd samples in the imaginary part.
+//
+// twiddles can be for a longer length than N, as long as it is N times a power of two
+//
+void realSpectrumToWave(int N, const vector<myFloat>& ar, vector<myFloat>& out, const fftTwiddles& twiddles)
+{
+    const int M = N >> 1;
+    const int step = twiddles.N / N;
+    vector<myFloat> zr(M), zi(M);
+
+    // H[k] for 0 <= k <= N/2; the DC and Nyquist terms only ever produce cosines
+    auto hermitian = [&](int k, myFloat& re, myFloat& im) {
+        re = 0.0;
+        im = (k == 0 || k == M) ? 0.0 : (ar[k] - ar[N - k]) * 0.5;
+    };
+
+    for (int k = 0; k < M; k++) {
+        myFloat hr, hi, gr, gi;
+        hermitian(k, hr, hi);
+        hermitian(M - k, gr, gi);
+        gi = -gi; // conj(H[N/2 - k])
+
+        myFloat er = hr + gr, ei = hi + gi;    // transform of the even samples
+        myFloat dr = hr - gr, di = hi - gi;
+        myFloat wr = twiddles.re[k * step], wi = twiddles.im[k * step];
+        myFloat orr = dr * wr - di * wi;        // transform of the odd samples
+        myFloat oi = dr * wi + di * wr;
+
+        zr[k] = er - oi;                        // even + i * odd
+        zi[k] = ei + orr;
+    }
+
+    // in-place inverse complex fft of size M, twiddles taken from the size N table
+    int j = 0;
+    for (int i = 0; i < M - 1; i++) {
+        if (i < j) {
+            swap(zr[i], zr[j]);
+            swap(zi[i], zi[j]);
+        }
+        int k = M >> 1;
+        while (k <= j) {
+            j -= k;
+            k >>= 1;
+        }
+        j += k;
+    }
+
+    for (int LE = 2; LE <= M; LE <<= 1) {
+        const int LE1 = LE >> 1;
+        const int stride = N / LE * step;
+        for (int jj = 0; jj < LE1; jj++) {
+            const myFloat Ur = twiddles.re[jj * stride];
+            const myFloat Ui = twiddles.im[jj * stride];
+            for (int i = jj; i < M; i += LE) {
+                const int ip = i + LE1;
+                myFloat Tr = zr[ip] * Ur - zi[ip] * Ui;
+                myFloat Ti = zr[ip] * Ui + zi[ip] * Ur;
+                zr[ip] = zr[i] - Tr;
+                zi[ip] = zi[i] - Ti;
+                zr[i] += Tr;
+                zi[i] += Ti;
+            }
+        }
+    }
+
+    for (int m = 0; m < M; m++) {
+        out[2 * m] = zr[m];
+        out[2 * m + 1] = zi[m];
+    }
+}
+
 void defineSine(int len, vector<myFloat>& ar, vector<myFloat>& ai)
 {
     // clear
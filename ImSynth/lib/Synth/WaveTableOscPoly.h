@@ -24,89 +24,244 @@
 
 #include <iostream>
 #include <vector>
+#include <algorithm>
+#include <atomic>
 #include <math.h>
 
 using namespace std;
 
 #include "MIDI.h"
 #include "randomFloat.h"
+#include "WaveTable.h"
 
-#ifndef M_PI
-#define M_PI  (3.14159265)
+#define maxVoices (32)  // maximum number of oscillators per stack
+#define maxBlockSize (1024) // largest block rendered in one pass; longer requests are split
+
+// SIMD note kernel: SSE2 is always there on x64, and on x86 unless /arch:IA32 is set
+#ifndef useSIMDKernel
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define useSIMDKernel (1)
+#else
+#define useSIMDKernel (0)
+#endif
+#endif
+
+#if useSIMDKernel
+#include <emmintrin.h>
+#endif
+
+#include "SmoothedParam.h"
+#include "Envelope.h"
+#include "NoteFilter.h"
+
+#define noteLanes (4)   // notes processed together by the SIMD kernel
+
+// Phase accumulator format. By default phases are doubles counting cycles, 0 to 1. With fixedPointPhase
+// they are unsigned 32 bit fractions of a cycle: the wrap is the integer overflow, and phase * table length
+// as a 64 bit product gives the table index in its top half and the interpolation fraction in its bottom
+// half, for any table length, with no compare, no subtract and no float to int conversion per sample
+#ifndef fixedPointPhase
+#define fixedPointPhase (0)
+#endif
+
+#if fixedPointPhase
+typedef uint32_t phaseAccumulator;
+#define phaseCycle (4294967296.0)   // accumulator units per cycle
+#else
+typedef double phaseAccumulator;
+#define phaseCycle (1.0)
+#endif
+
+// cycles (a normalised frequency, or a phase 0 to 1) to accumulator units
+inline phaseAccumulator toPhase(double cycles) {
+#if fixedPointPhase
+    return (phaseAccumulator)(int64_t)(cycles * phaseCycle + 0.5);   // modulo one cycle, so 1.0 is 0
+#else
+    return cycles;
+#endif
+}
+
+inline double phaseToCycles(phaseAccumulator phase) {
+    return phase / phaseCycle;
+}
+
+// phase + inc, wrapped to one cycle
+inline phaseAccumulator advancePhase(phaseAccumulator phase, phaseAccumulator inc) {
+#if fixedPointPhase
+    return phase + inc;
+#else
+    phase += inc;
+    if (phase >= 1.0)
+        phase -= 1.0;
+    return phase;
+#endif
+}
+
+// linearly interpolated sample of a table level at phase
+inline float lookupPhase(const waveTableLevel* thisTable, phaseAccumulator phase) {
+#if fixedPointPhase
+    uint64_t position = (uint64_t)phase * (uint32_t)thisTable->waveTableLen;
+    int intPart = (int)(position >> 32);
+    float fracPart = (float)((uint32_t)position >> 8) * (1.0f / 16777216.0f);   // top 24 bits, exact in a float
+#else
+    float temp = phase * thisTable->waveTableLen;
+    int intPart = temp;
+    float fracPart = temp - intPart;
+
+    // wrap to avoid reading past the guard sample with intPart + 1
+    if (intPart == thisTable->waveTableLen) {
+        intPart = 0;
+    }
 #endif
+    float samp0 = thisTable->samples[intPart];
+    float samp1 = thisTable->samples[intPart + 1];
+    return samp0 + (samp1 - samp0) * fracPart;
+}
 
+#if useSIMDKernel
 //
-// some things to tweak for testing and experimenting
+// lanePhases: the phases of noteLanes notes in SSE registers, for the SIMD kernels. step() advances them
+// one sample and returns each lane's table index and interpolation fraction
 //
-#define sampleRate (44100)
+#if fixedPointPhase
+struct lanePhases {
+    lanePhases(const phaseAccumulator* phasor, const phaseAccumulator* phaseInc, const int* len) {
+        mPhase = _mm_loadu_si128((const __m128i*)phasor);
+        mInc = _mm_loadu_si128((const __m128i*)phaseInc);
+        mLen02 = _mm_set_epi32(0, len[2], 0, len[0]);
+        mLen13 = _mm_set_epi32(0, len[3], 0, len[1]);
+    }
 
-// oscillator
-#define overSamp (2)        /* oversampling factor (positive integer) */
-#define baseFrequency (20)  /* starting frequency of first table */
-#define constantRatioLimit (99999)    /* set to a large number (greater than or equal to the length of the lowest octave table) for constant table size; set to 0 for a constant oversampling ratio (each higher ocatave table length reduced by half); set somewhere between (64, for instance) for constant oversampling but with a minimum limit */
+    inline __m128i step(__m128& fracPart) {
+        mPhase = _mm_add_epi32(mPhase, mInc);
+
+        // 64 bit phase * len for lanes 0 and 2, then for lanes 1 and 3
+        __m128i prod02 = _mm_mul_epu32(mPhase, mLen02);
+        __m128i prod13 = _mm_mul_epu32(_mm_srli_epi64(mPhase, 32), mLen13);
+        const __m128i high = _mm_set_epi32(-1, 0, -1, 0);
+        __m128i intPart = _mm_or_si128(_mm_srli_epi64(prod02, 32), _mm_and_si128(prod13, high));
+        __m128i fraction = _mm_or_si128(_mm_andnot_si128(high, prod02), _mm_slli_epi64(prod13, 32));
+        fracPart = _mm_mul_ps(_mm_cvtepi32_ps(_mm_srli_epi32(fraction, 8)), _mm_set1_ps(1.0f / 16777216.0f));
+        return intPart;
+    }
 
-#define myFloat double      /* float or double, to set the resolution of the FFT, etc. (the resulting wavetables are always float) */
+    void store(phaseAccumulator* phasor) {
+        _mm_storeu_si128((__m128i*)phasor, mPhase);
+    }
+
+    __m128i mPhase, mInc, mLen02, mLen13;
+};
+#else
+struct lanePhases {
+    lanePhases(const phaseAccumulator* phasor, const phaseAccumulator* phaseInc, const int* len) {
+        mPhasor01 = _mm_loadu_pd(&phasor[0]);
+        mPhasor23 = _mm_loadu_pd(&phasor[2]);
+        mInc01 = _mm_loadu_pd(&phaseInc[0]);
+        mInc23 = _mm_loadu_pd(&phaseInc[2]);
+        mLen01 = _mm_set_pd(len[1], len[0]);
+        mLen23 = _mm_set_pd(len[3], len[2]);
+        mLenInt = _mm_set_epi32(len[3], len[2], len[1], len[0]);
+    }
 
-#define numberOfShapes (4) // total number of wave shapes implemented
-#define maxVoices (8)  // maximum number of oscillators per stack
+    inline __m128i step(__m128& fracPart) {
+        const __m128d one = _mm_set1_pd(1.0);
+        mPhasor01 = _mm_add_pd(mPhasor01, mInc01);
+        mPhasor23 = _mm_add_pd(mPhasor23, mInc23);
+        mPhasor01 = _mm_sub_pd(mPhasor01, _mm_and_pd(_mm_cmpge_pd(mPhasor01, one), one));
+        mPhasor23 = _mm_sub_pd(mPhasor23, _mm_and_pd(_mm_cmpge_pd(mPhasor23, one), one));
 
-#define baseFrequency (20)  /* starting frequency of first table */
+        __m128d temp01 = _mm_mul_pd(mPhasor01, mLen01);
+        __m128d temp23 = _mm_mul_pd(mPhasor23, mLen23);
+        __m128i int01 = _mm_cvttpd_epi32(temp01);
+        __m128i int23 = _mm_cvttpd_epi32(temp23);
+        fracPart = _mm_movelh_ps(_mm_cvtpd_ps(_mm_sub_pd(temp01, _mm_cvtepi32_pd(int01))),
+                                 _mm_cvtpd_ps(_mm_sub_pd(temp23, _mm_cvtepi32_pd(int23))));
 
-struct waveTable {
-    double topFreq;
-    int waveTableLen;
-    vector<float> waveTable_;
+        // wrap to avoid reading past the guard sample with intPart + 1
+        __m128i intPart = _mm_unpacklo_epi64(int01, int23);
+        return _mm_andnot_si128(_mm_cmpeq_epi32(intPart, mLenInt), intPart);
+    }
+
+    void store(phaseAccumulator* phasor) {
+        _mm_storeu_pd(&phasor[0], mPhasor01);
+        _mm_storeu_pd(&phasor[2], mPhasor23);
+    }
+
+    __m128d mPhasor01, mPhasor23, mInc01, mInc23, mLen01, mLen23;
+    __m128i mLenInt;
 };
+#endif
+#endif
 
+// per-note state, stored as structure-of-arrays so that the SIMD kernel can load several notes at once
 struct perNoteData {
-    double mPhasor = randomFloat(0.0, 1.0);       // phase accumulator
-    double mPhaseInc = 0.0;     // phase increment
-    int mCurWaveTable = 0;      // current table, based on current frequency
+    phaseAccumulator mPhasor[maxPolyphony];     // phase accumulator
+    phaseAccumulator mPhaseInc[maxPolyphony];   // phase increment
+    int mCurWaveTable[maxPolyphony];    // current table, based on current frequency
 };
 
 class WaveTableOsc {
 public:
     WaveTableOsc(void) {
-        waveTable newTable;
-        for (int idx = 0; idx < numWaveTableSlots; idx++) {
-            mWaveTables.push_back(newTable);
-        }
-        perNoteData note;
         for (int p = 0; p < maxPolyphony; p++) {
-            notes.push_back(note);
+            notes.mPhasor[p] = toPhase(randomFloat(0.0, 1.0));
+            notes.mPhaseInc[p] = 0;
+            notes.mCurWaveTable[p] = 0;
+            mActivePosition[p] = -1;
         }
     }
-    ~WaveTableOsc(void) {
-        mWaveTables.clear();
-    }
+    // the bank pointer is atomic, so oscillators live in place and are never copied
+    WaveTableOsc(const WaveTableOsc&) = delete;
+    WaveTableOsc& operator=(const WaveTableOsc&) = delete;
 
     //
     // SetFrequency: Set normalized frequency, typically 0-0.5 (must be positive and less than 1!)
     //
     void setFrequency(double inc, int noteIndex) {
-            notes[noteIndex].mPhaseInc = inc;
+            notes.mPhaseInc[noteIndex] = toPhase(inc);
 
             // update the current wave table selector
-            int curWaveTable = 0;
-            while ((notes[noteIndex].mPhaseInc >= mWaveTables[curWaveTable].topFreq) && (curWaveTable < (mNumWaveTables - 1))) {
-                ++curWaveTable;
+            const waveTableBank* bank = mWaveTables.load(memory_order_acquire);
+            notes.mCurWaveTable[noteIndex] = bank ? levelForIncrement(bank, inc) : 0;
+
+            // keep the dense list of sounding notes in step
+            if (inc != 0.0 && mActivePosition[noteIndex] < 0) {
+                mActivePosition[noteIndex] = mNumActiveNotes;
+                mActiveNotes[mNumActiveNotes++] = noteIndex;
+            } else if (inc == 0.0 && mActivePosition[noteIndex] >= 0) {
+                int last = mActiveNotes[--mNumActiveNotes];
+                mActiveNotes[mActivePosition[noteIndex]] = last;
+                mActivePosition[last] = mActivePosition[noteIndex];
+                mActivePosition[noteIndex] = -1;
             }
+    }
 
-            notes[noteIndex].mCurWaveTable = curWaveTable;
+    int numActiveNotes() const {
+        return mNumActiveNotes;
+    }
+
+    // silences every note, e.g. for an oscillator that is no longer one of the stack's voices
+    void silenceAll() {
+        for (int a = 0; a < mNumActiveNotes; a++) {
+            int p = mActiveNotes[a];
+            notes.mPhaseInc[p] = 0;
+            mActivePosition[p] = -1;
+        }
+        mNumActiveNotes = 0;
     }
 
     //
     // resetPhase: Reset phase (for retrig)
     //
     void setPhases(float phase) {
-        for (auto& note : notes) {
-            note.mPhasor = phase;
+        for (int p = 0; p < maxPolyphony; p++) {
+            notes.mPhasor[p] = toPhase(phase);
         }
     }
 
     void randomisePhases() {
-        for (auto& note : notes) {
-            note.mPhasor = randomFloat(0.0, 1.0);
+        for (int p = 0; p < maxPolyphony; p++) {
+            notes.mPhasor[p] = toPhase(randomFloat(0.0, 1.0));
         }
     }
 
@@ -114,11 +269,9 @@ public:
     // UpdatePhase: Call once per sample
     //
     void updatePhases(void) {
-        for (auto& note : notes) {
-            note.mPhasor += note.mPhaseInc;
-
-            if (note.mPhasor >= 1.0)
-                note.mPhasor -= 1.0;
+        for (int a = 0; a < mNumActiveNotes; a++) {
+            int p = mActiveNotes[a];
+            notes.mPhasor[p] = advancePhase(notes.mPhasor[p], notes.mPhaseInc[p]);
         }
     }
 
@@ -130,72 +283,221 @@ public:
         return getOutput();
     }
 
+    //
+    // ProcessBlock: Update phases and add the output of every note into out, for a whole block
+    //
+    void processBlock(float* out, int frames) {
+        processBlock(out, frames, 0, mNumActiveNotes);
+    }
+
+    // only active notes firstActive to endActive - 1, so separate threads can render separate ranges.
+    // With pitchRatio, each note's increment is scaled by pitchRatio[n] at sample n
+    void processBlock(float* out, int frames, int firstActive, int endActive, const float* pitchRatio = nullptr) {
+        endActive = min(endActive, mNumActiveNotes);
+        if (pitchRatio) {
+            processBlockModulated(out, frames, firstActive, endActive, pitchRatio);
+            return;
+        }
+#if useSIMDKernel
+        processBlockSIMD(out, frames, firstActive, endActive);
+#else
+        processBlockScalar(out, frames, firstActive, endActive);
+#endif
+    }
+
+    //
+    // ProcessBlockScalar: one note at a time; the fallback, and the reference for the SIMD kernel
+    //
+    void processBlockScalar(float* out, int frames, int firstActive, int endActive) {
+        const waveTableBank* bank = mWaveTables.load(memory_order_acquire);
+        if (!bank)
+            return;
+        const int lastLevel = (int)bank->levels.size() - 1;
+
+        for (int a = firstActive; a < endActive; a++) {
+            int p = mActiveNotes[a];
+            const waveTableLevel* thisTable = &bank->levels[min(notes.mCurWaveTable[p], lastLevel)];
+            const phaseAccumulator phaseInc = notes.mPhaseInc[p];
+            phaseAccumulator phasor = notes.mPhasor[p];
+
+            // same maths as process(), with the note's state kept in registers for the block
+            for (int n = 0; n < frames; n++) {
+                phasor = advancePhase(phasor, phaseInc);
+                out[n] += lookupPhase(thisTable, phasor);
+            }
+
+            notes.mPhasor[p] = phasor;
+        }
+    }
+
+    //
+    // ProcessBlockModulated: as processBlockScalar, with the increment, and so the table level,
+    // changing every sample for pitch bend, vibrato and the like. The level is picked with
+    // levelForIncrement, a few integer operations, so every sample can have its own
+    //
+    void processBlockModulated(float* out, int frames, int firstActive, int endActive, const float* pitchRatio) {
+        const waveTableBank* bank = mWaveTables.load(memory_order_acquire);
+        if (!bank)
+            return;
+
+        for (int a = firstActive; a < endActive; a++) {
+            int p = mActiveNotes[a];
+            const double phaseInc = phaseToCycles(notes.mPhaseInc[p]);
+            phaseAccumulator phasor = notes.mPhasor[p];
+
+            for (int n = 0; n < frames; n++) {
+                const double inc = phaseInc * pitchRatio[n];
+                const waveTableLevel* thisTable = &bank->levels[levelForIncrement(bank, inc)];
+                phasor = advancePhase(phasor, toPhase(inc));
+                out[n] += lookupPhase(thisTable, phasor);
+            }
+
+            notes.mPhasor[p] = phasor;
+        }
+    }
+
+#if useSIMDKernel
+    //
+    // ProcessBlockSIMD: advances noteLanes active notes at once, with their table lookups
+    // gathered lane by lane and interpolated together
+    //
+    void processBlockSIMD(float* out, int frames, int firstActive, int endActive) {
+        static const float silence[2] = { 0.0f, 0.0f };
+
+        const waveTableBank* bank = mWaveTables.load(memory_order_acquire);
+        if (!bank)
+            return;
+        const int lastLevel = (int)bank->levels.size() - 1;
+
+        for (int first = firstActive; first < endActive; first += noteLanes) {
+            const float* wave[noteLanes];
+            int len[noteLanes];
+            phaseAccumulator phasor[noteLanes];
+            phaseAccumulator phaseInc[noteLanes];
+
+            // lanes past the end of the active list read a zero table at index 0, so they need no masking in the loop
+            for (int lane = 0; lane < noteLanes; lane++) {
+                if (first + lane < endActive) {
+                    int p = mActiveNotes[first + lane];
+                    const waveTableLevel* thisTable = &bank->levels[min(notes.mCurWaveTable[p], lastLevel)];
+                    wave[lane] = thisTable->samples;
+                    len[lane] = thisTable->waveTableLen;
+                    phasor[lane] = notes.mPhasor[p];
+                    phaseInc[lane] = notes.mPhaseInc[p];
+                } else {
+                    wave[lane] = silence;
+                    len[lane] = 0;
+                    phasor[lane] = 0;
+                    phaseInc[lane] = 0;
+                }
+            }
+
+            lanePhases phases(phasor, phaseInc, len);
+
+            for (int n = 0; n < frames; n++) {
+                __m128 fracPart;
+                alignas(16) int idx[noteLanes];
+                _mm_store_si128((__m128i*)idx, phases.step(fracPart));
+
+                __m128 samp0 = _mm_set_ps(wave[3][idx[3]], wave[2][idx[2]], wave[1][idx[1]], wave[0][idx[0]]);
+                __m128 samp1 = _mm_set_ps(wave[3][idx[3] + 1], wave[2][idx[2] + 1], wave[1][idx[1] + 1], wave[0][idx[0] + 1]);
+                __m128 samp = _mm_add_ps(samp0, _mm_mul_ps(_mm_sub_ps(samp1, samp0), fracPart));
+
+                // horizontal sum of the group
+                __m128 shuf = _mm_shuffle_ps(samp, samp, _MM_SHUFFLE(2, 3, 0, 1));
+                __m128 sums = _mm_add_ps(samp, shuf);
+                shuf = _mm_movehl_ps(shuf, sums);
+                sums = _mm_add_ss(sums, shuf);
+                out[n] += _mm_cvtss_f32(sums);
+            }
+
+            phases.store(phasor);
+            for (int lane = 0; lane < noteLanes && first + lane < endActive; lane++) {
+                notes.mPhasor[mActiveNotes[first + lane]] = phasor[lane];
+            }
+        }
+    }
+#endif
+
     //
     // GetOutput: Returns the current oscillator output
     //
     float getOutput(void) {
+        const waveTableBank* bank = mWaveTables.load(memory_order_acquire);
+        if (!bank)
+            return 0.0;
+        const int lastLevel = (int)bank->levels.size() - 1;
+
         float out = 0.0;
-        for (auto& note : notes) {
-            if (note.mPhaseInc != 0.0) {
-                // important to define pointer instead of new waveTable for performance!
-                waveTable* thisTable = &mWaveTables[note.mCurWaveTable];
-
-                //while (thisTable->waveTable_.size() != 4097 || thisTable->waveTableLen != 4096) {
-                //    return 0.0;
-                //}
-
-                // linear interpolation
-                float temp = note.mPhasor * thisTable->waveTableLen;
-                int intPart = temp;
-                float fracPart = temp - intPart;
-
-                // wrap to avoid vector subscript out of range with intPart + 1
-                if (intPart == thisTable->waveTableLen) {
-                    intPart = 0;
-                }
+        for (int a = 0; a < mNumActiveNotes; a++) {
+            int p = mActiveNotes[a];
+            // important to define pointer instead of new waveTable for performance!
+            const waveTableLevel* thisTable = &bank->levels[min(notes.mCurWaveTable[p], lastLevel)];
 
-                float samp0 = thisTable->waveTable_[intPart];
-                float samp1 = thisTable->waveTable_[intPart + 1];
-                out += samp0 + (samp1 - samp0) * fracPart;
-            }
+            //while (thisTable->waveTable_.size() != 4097 || thisTable->waveTableLen != 4096) {
+            //    return 0.0;
+            //}
+
+            // linear interpolation
+            out += lookupPhase(thisTable, notes.mPhasor[p]);
         }
         return out;
     }
 
-    void setTables(vector<waveTable>* tables) {
-        mWaveTables = *tables;
-        mNumWaveTables = mWaveTables.size();
+    //
+    // SetTables: point at a shared bank; a single pointer swap, safe while the audio thread is playing.
+    // The caller keeps the bank alive (see WaveTableOscStack::setAllTables)
+    //
+    void setTables(const waveTableBank* bank) {
+        mWaveTables.store(bank, memory_order_release);
     }
 
-    vector<waveTable>* getTables() {
-        return &mWaveTables;
+    const waveTableBank* getTables() const {
+        return mWaveTables.load(memory_order_acquire);
     }
 
     void clearTables() {
-        mWaveTables.clear();
+        mWaveTables.store(nullptr, memory_order_release);
     }
 
 protected:
-    vector<perNoteData> notes;
-    int mNumWaveTables = 0;     // number of wavetable slots in use
-    static constexpr int numWaveTableSlots = 40;    // simplify allocation with reasonable maximum
-    vector<waveTable> mWaveTables;
+    friend class WaveTableOscStack;     // its stereo kernel reads every voice's notes at once
+
+    perNoteData notes;
+    int mActiveNotes[maxPolyphony];     // dense list of the notes with a non-zero increment
+    int mActivePosition[maxPolyphony];  // each note's position in mActiveNotes, or -1 when silent
+    int mNumActiveNotes = 0;
+    atomic<const waveTableBank*> mWaveTables{ nullptr };
+};
+
+// the filter's unison sums for one group of notes, interleaved: frame n of lane l at [n * noteLanes + l].
+// Too big for an audio or render thread's stack, so each thread rendering filtered notes keeps one
+struct filterSums {
+    alignas(16) float left[maxBlockSize * noteLanes];
+    alignas(16) float right[maxBlockSize * noteLanes];
 };
 
 class WaveTableOscStack {
 public:
 
-    WaveTableOscStack() {
-        for (int n = 0; n < maxVoices; n++) {
-            WaveTableOsc newOsc;
-            mOscillators.push_back(newOsc);
-        }
+    WaveTableOscStack() : mOscillators(maxVoices), mFilterSums(1) {
+        mStackBuffer.resize(maxBlockSize);
+        fill(begin(mNoteFreqs), end(mNoteFreqs), 0.0);
+        fill(begin(mDetuneRatios), end(mDetuneRatios), 1.0);
+        fill(&mPanGains[0][0], &mPanGains[0][0] + maxVoices * 2, 1.0f);
+        fill(&mFilterState[0][0], &mFilterState[0][0] + maxPolyphony * 4, 0.0f);
+        fill(begin(mFilterG), end(mFilterG), 0.0f);
+        fill(begin(mKeyOctaves), end(mKeyOctaves), 0.0f);
+        refreshPan();
         //randomiseAllPhases();
     }
 
     ~WaveTableOscStack(void) {
         mOscillators.clear();
     }
+
+    WaveTableOscStack(const WaveTableOscStack&) = delete;
+    WaveTableOscStack& operator=(const WaveTableOscStack&) = delete;
     
     float processAll() {
         float out = 0.0;
@@ -205,26 +507,230 @@ public:
                 out += mOscillators[n].process();
             }
         }
-        return out * amplitude;
+        // mono, with no panning or amplitude glide; see processBlockStereo
+        return out * amplitude.current();
+    }
 
-        // implement panning spread
+    // true when the stack would add nothing to the mix
+    bool isSilent() const {
+        return !stackOn || mOscillators[0].numActiveNotes() == 0;
+    }
+
+    // adds the stack's output for a block of frames into out; pitchRatio, if given, has a ratio for every frame
+    void processBlock(float* out, int frames, const float* pitchRatio = nullptr) {
+        if (isSilent()) {
+            return;
+        }
+
+        for (int offset = 0; offset < frames; offset += maxBlockSize) {
+            int blockFrames = min(frames - offset, maxBlockSize);
+            float* stackOut = mStackBuffer.data();
+
+            fill(stackOut, stackOut + blockFrames, 0.0f);
+            for (int n = 0; n < voices; n++) {
+                mOscillators[n].processBlock(stackOut, blockFrames, 0, maxPolyphony, pitchRatio ? pitchRatio + offset : nullptr);
+            }
+
+            float* blockOut = out + offset;
+            const float gain = amplitude.current();
+            for (int i = 0; i < blockFrames; i++) {
+                blockOut[i] += stackOut[i] * gain;
+            }
+        }
+    }
+
+    // every voice plays the same notes, so this is also each oscillator's active note count
+    int numActiveNotes() const {
+        return mOscillators[0].numActiveNotes();
+    }
+
+    // note voices to render: every voice plays every active note
+    int numNoteVoices() const {
+        return isSilent() ? 0 : voices * numActiveNotes();
+    }
+
+    //
+    // ProcessBlockStereo: adds the stack's output, panned and scaled by amplitude, into outL and outR.
+    // Renders note voices first to end - 1, counting voice by voice through the active notes, so the
+    // RenderPool can give separate ranges to separate threads. Frames at most maxBlockSize. Amplitude
+    // glides across the block; call advanceSmoothing once every range of the block is done. Each note
+    // is scaled by its slot's envelope, if given, after the filter when the filter is on. Threads rendering
+    // ranges at once each pass their own sums for the filter; without them the stack's own are used
+    //
+    void processBlockStereo(float* outL, float* outR, int frames, int first, int end, const float* pitchRatio = nullptr,
+        const envelopeSegments* envelopes = nullptr, filterSums* sums = nullptr) {
+        const waveTableBank* bank = mOscillators[0].getTables();
+        end = min(end, numNoteVoices());
+        if (!bank || first >= end) {
+            return;
+        }
+        const envelopeSegments& env = envelopes ? *envelopes : envelopeSegments::unity();
+        if (filterMode != filterOff) {
+            processFiltered(bank, outL, outR, frames, first, end, pitchRatio, env, sums ? *sums : mFilterSums[0]);
+            return;
+        }
+#if useSIMDKernel
+        if (!pitchRatio) {
+            if (amplitude.isRamping()) {
+                processStereoSIMD<true>(bank, outL, outR, frames, first, end, env);
+            } else {
+                processStereoSIMD<false>(bank, outL, outR, frames, first, end, env);
+            }
+            return;
+        }
+#endif
+        processStereoScalar(bank, outL, outR, frames, first, end, pitchRatio, env);
+    }
+
+    // one voice's pan, as gains for the left and right channels (both 1 in the centre)
+    float panGain(int voice, int channel) const {
+        return mPanGains[voice][channel];
+    }
+
+    void setSpread(float spread) {
+        unisonSpread = spread;
+        refreshPan();
+    }
+
+    void setPan(float newPan) {
+        pan = newPan;
+        refreshPan();
     }
 
     // freqs are already normalised
     void setFrequencies(double freq, int noteIndex) {
         // implement octave/semitone
+        if (freq != 0.0 && freq != mNoteFreqs[noteIndex]) {
+            // a note starting in a silent slot gets a clear filter; one taking over a sounding slot
+            // keeps it, so that it does not click
+            if (mNoteFreqs[noteIndex] == 0.0) {
+                fill(mFilterState[noteIndex], mFilterState[noteIndex] + 4, 0.0f);
+            }
+            mKeyOctaves[noteIndex] = log2f((float)(freq * sampleRate) / filterKeyCentre);
+            mFilterG[noteIndex] = noteFilterCoefficient(noteIndex, filterCutoff.current());
+        }
+        mNoteFreqs[noteIndex] = freq;
 
         for (int n = 0; n < voices; n++) {
-            double detuneMultiplier = pow(2, (unisonDetune / 100.0) * allDetuneSemitones[voices - 1][n] / 12.0);
+            mOscillators[n].setFrequency(freq * mDetuneRatios[n], noteIndex);
+        }
+    }
 
-            mOscillators[n].setFrequency(freq * detuneMultiplier, noteIndex);
+    // amplitude and detune glide to a new value while the stack sounds, and jump to it when it is silent
+    void setAmplitude(double amp) {
+        if (isSilent()) {
+            mBaseAmplitude.reset((float)amp);
+            amplitude.reset((float)amp * mModGain);
+        } else {
+            mBaseAmplitude.setTarget((float)amp, smoothingFrames);
+            amplitude.setTarget((float)amp * mModGain, smoothingFrames);
         }
     }
 
-    void setAllTables(vector<waveTable>* tables) {
+    void setVoices(int newVoices) {
+        voices = max(1, min(newVoices, maxVoices));
+        refreshFrequencies();
+    }
+
+    void setDetune(float detune) {
+        if (isSilent()) {
+            unisonDetune.reset(detune);
+            refreshDetune();
+        } else {
+            unisonDetune.setTarget(detune, smoothingFrames);
+        }
+    }
+
+    // the filter cutoff glides in pitch, like amplitude and detune
+    void setFilterCutoff(float hz) {
+        float cutoff = log2f(max(filterMinCutoff, min(hz, filterMaxCutoff)));
+        if (isSilent()) {
+            filterCutoff.reset(cutoff);
+        } else {
+            filterCutoff.setTarget(cutoff, smoothingFrames);
+        }
+    }
+
+    // a filter switched on starts clear, with every sounding note's coefficient up to date
+    void setFilterMode(int mode) {
+        mode = max((int)filterOff, min(mode, numberOfFilterModes - 1));
+        if (filterMode == filterOff && mode != filterOff) {
+            fill(&mFilterState[0][0], &mFilterState[0][0] + maxPolyphony * 4, 0.0f);
+            for (int p = 0; p < maxPolyphony; p++) {
+                if (mNoteFreqs[p] != 0.0) {
+                    mFilterG[p] = noteFilterCoefficient(p, filterCutoff.current());
+                }
+            }
+        }
+        filterMode = mode;
+    }
+
+    //
+    // Control-rate modulation (see Modulation.h), as offsets from the parameters as set: the amplitude is
+    // multiplied by gain, gliding there over the next frames, while detune, pan and cutoff (in octaves)
+    // step. Each only does any work when it changes
+    //
+    void setModulation(float gain, float detune, float panOffset, float cutoffOctaves, int frames) {
+        mModGain = gain;
+        const float target = mBaseAmplitude.valueAfter(frames) * gain;
+        if (target != amplitude.current() || amplitude.isRamping()) {
+            amplitude.setTarget(target, frames);
+        }
+        if (detune != mDetuneMod) {
+            mDetuneMod = detune;
+            refreshDetune();
+        }
+        if (panOffset != mPanMod) {
+            mPanMod = panOffset;
+            refreshPan();
+        }
+        mCutoffMod = cutoffOctaves;
+    }
+
+    const waveTableBank* getTables() const {
+        return mBank.get();
+    }
+
+    // moves the glides on past a rendered block; detune steps once a block, which is smooth enough for pitch
+    void advanceSmoothing(int frames) {
+        mBaseAmplitude.advance(frames);
+        amplitude.advance(frames);
+        filterCutoff.advance(frames);
+        if (unisonDetune.isRamping()) {
+            unisonDetune.advance(frames);
+            refreshDetune();
+        }
+    }
+
+    // re-applies every note's frequency after the voice count or detune has changed
+    void refreshFrequencies() {
+        refreshPan();
+        for (int n = voices; n < maxVoices; n++) {
+            mOscillators[n].silenceAll();
+        }
+        refreshDetune();
+    }
+
+    // each voice's detune ratio for the current detune, and every sounding note's frequencies with them
+    void refreshDetune() {
+        // the only place the detune curve is evaluated; setFrequencies just multiplies
+        const float detune = max(0.0f, min(unisonDetune.current() + mDetuneMod, 100.0f));
+        for (int n = 0; n < voices; n++) {
+            mDetuneRatios[n] = pow(2, (detune / 100.0) * unisonPosition(voices, n) / 12.0);
+        }
+        for (int p = 0; p < maxPolyphony; p++) {
+            if (mNoteFreqs[p] != 0.0) {
+                setFrequencies(mNoteFreqs[p], p);
+            }
+        }
+    }
+
+    // the stack holds a reference to the bank for as long as its oscillators point at it
+    void setAllTables(const sharedWaveTableBank& bank) {
         for (auto& mOscillator : mOscillators) {
-            mOscillator.setTables(tables);
+            mOscillator.setTables(bank.get());
         }
+        mBank = bank;
     }
 
     void resetAllPhases() {
@@ -239,45 +745,468 @@ public:
         }
     }
 
-    // parameters that can be directly edited by external processes
+    // where voice n of count sits in the unison, from -1 (lowest, leftmost) to 1 (highest, rightmost),
+    // evenly spaced. Detune and pan spread both scale it
+    static double unisonPosition(int count, int n) {
+        return count > 1 ? -1.0 + 2.0 * n / (count - 1) : 0.0;
+    }
+
+    // parameters that can be directly edited by the thread that renders the stack;
+    // voices needs refreshFrequencies() afterwards (or use setVoices),
+    // unisonSpread and pan need refreshPan() (or use setSpread/setPan)
     bool    stackOn = true;
     int     shape = 0;
     int     voices = 1;
-    float   unisonDetune = 0.0;
-    float   unisonSpread = 100.0;
-    int     pan = 0;
-    float   amplitude = 0.5;
+    float   unisonSpread = 100.0;   // 0 (every voice at pan) to 100 (voices across the whole field)
+    float   pan = 0.0;              // -100 (left) to 100 (right)
+
+    // set with setDetune and setAmplitude, which glide; amplitude is the gain the kernels apply, the
+    // amplitude as set times any modulation
+    SmoothedParam unisonDetune{ 0.0f };
+    SmoothedParam amplitude{ 0.5f };
+
+    // per-note filter: filterMode is set with setFilterMode and filterCutoff (log2 Hz) with setFilterCutoff;
+    // resonance and key tracking can be edited directly, and take effect at the next envelope update
+    int     filterMode = filterOff;
+    float   filterResonance = 0.0f;     // 0-1
+    float   filterKeyTrack = 0.0f;      // 0 (the same cutoff for every note) to 1 (the cutoff follows the note)
+    SmoothedParam filterCutoff{ log2f(filterMaxCutoff) };
+
+    // equal power pan of each voice in use, normalised so that a centred voice has unity gain in both channels
+    // (the mono mix level). Pan modulation calls this every tick, so voices past the count are left alone
+    void refreshPan() {
+        for (int n = 0; n < voices; n++) {
+            double position = (pan + mPanMod) / 100.0 + (unisonSpread / 100.0) * unisonPosition(voices, n);
+            position = max(-1.0, min(position, 1.0));
+            double angle = (position + 1.0) * M_PI / 4.0;
+            mPanGains[n][0] = (float)(cos(angle) * sqrt(2.0));
+            mPanGains[n][1] = (float)(sin(angle) * sqrt(2.0));
+        }
+    }
 
 protected:
+    // per-lane state of a group of note voices, gathered from the oscillators
+    struct laneGroup {
+        const float* wave[noteLanes];
+        int len[noteLanes];
+        phaseAccumulator phasor[noteLanes];
+        phaseAccumulator phaseInc[noteLanes];
+        float gainL[noteLanes];
+        float gainR[noteLanes];
+        float gainStepL[noteLanes];     // per frame, for the first rampFrames frames
+        float gainStepR[noteLanes];
+        int voice[noteLanes];
+        int note[noteLanes];
+        int count;
+        int rampFrames;                 // frames of the block on which the amplitude glides
+    };
+
+    // note voice index = voice * numActiveNotes() + position in the voice's active list
+    void gatherLanes(const waveTableBank* bank, int first, int end, int frames, laneGroup& group) {
+        static const float silence[2] = { 0.0f, 0.0f };
+        const int notesPerVoice = numActiveNotes();
+        const int lastLevel = (int)bank->levels.size() - 1;
+        const float startAmp = amplitude.current();
+        const float ampStep = amplitude.step();
+
+        group.count = min(noteLanes, end - first);
+        group.rampFrames = amplitude.rampFrames(frames);
+        for (int lane = 0; lane < noteLanes; lane++) {
+            // lanes past the end read a zero table at index 0, with no gain, so they need no masking in the loop
+            if (lane < group.count) {
+                int voice = (first + lane) / notesPerVoice;
+                const WaveTableOsc& osc = mOscillators[voice];
+                int p = osc.mActiveNotes[(first + lane) % notesPerVoice];
+                const waveTableLevel* thisTable = &bank->levels[min(osc.notes.mCurWaveTable[p], lastLevel)];
+                group.wave[lane] = thisTable->samples;
+                group.len[lane] = thisTable->waveTableLen;
+                group.phasor[lane] = osc.notes.mPhasor[p];
+                group.phaseInc[lane] = osc.notes.mPhaseInc[p];
+                group.gainL[lane] = mPanGains[voice][0] * startAmp;
+                group.gainR[lane] = mPanGains[voice][1] * startAmp;
+                group.gainStepL[lane] = mPanGains[voice][0] * ampStep;
+                group.gainStepR[lane] = mPanGains[voice][1] * ampStep;
+                group.voice[lane] = voice;
+                group.note[lane] = p;
+            } else {
+                group.wave[lane] = silence;
+                group.len[lane] = 0;
+                group.phasor[lane] = 0;
+                group.phaseInc[lane] = 0;
+                group.gainL[lane] = 0.0f;
+                group.gainR[lane] = 0.0f;
+                group.gainStepL[lane] = 0.0f;
+                group.gainStepR[lane] = 0.0f;
+                group.note[lane] = 0;
+            }
+        }
+    }
+
+    void storePhases(const laneGroup& group) {
+        for (int lane = 0; lane < group.count; lane++) {
+            mOscillators[group.voice[lane]].notes.mPhasor[group.note[lane]] = group.phasor[lane];
+        }
+    }
+
+    // one note voice at a time, with an optional per-frame pitch ratio (see WaveTableOsc::processBlockModulated)
+    void processStereoScalar(const waveTableBank* bank, float* outL, float* outR, int frames, int first, int end, const float* pitchRatio,
+        const envelopeSegments& env) {
+        laneGroup group;
+        for (int start = first; start < end; start += noteLanes) {
+            gatherLanes(bank, start, end, frames, group);
+
+            for (int lane = 0; lane < group.count; lane++) {
+                const phaseAccumulator phaseInc = group.phaseInc[lane];
+                const double phaseIncCycles = phaseToCycles(phaseInc);
+                const float gainL = group.gainL[lane];
+                const float gainR = group.gainR[lane];
+                const float gainStepL = group.gainStepL[lane];
+                const float gainStepR = group.gainStepR[lane];
+                const waveTableLevel* thisTable = &bank->levels[levelForIncrement(bank, phaseIncCycles)];
+                phaseAccumulator phasor = group.phasor[lane];
+                const int p = group.note[lane];
+
+                for (int seg = 0, n = 0; n < frames; seg++) {
+                    float envLevel = env.level[seg][p];
+                    const float envStep = env.step[seg][p];
+                    const int segEnd = min(frames, n + env.length[seg]);
+
+                    for (; n < segEnd; n++) {
+                        phaseAccumulator inc = phaseInc;
+                        if (pitchRatio) {
+                            const double cycles = phaseIncCycles * pitchRatio[n];
+                            thisTable = &bank->levels[levelForIncrement(bank, cycles)];
+                            inc = toPhase(cycles);
+                        }
+
+                        phasor = advancePhase(phasor, inc);
+                        envLevel += envStep;
+                        float samp = lookupPhase(thisTable, phasor) * envLevel;
+                        const int rampFrame = min(n + 1, group.rampFrames);
+                        outL[n] += samp * (gainL + gainStepL * rampFrame);
+                        outR[n] += samp * (gainR + gainStepR * rampFrame);
+                    }
+                }
+
+                group.phasor[lane] = phasor;
+            }
+
+            storePhases(group);
+        }
+    }
+
+#if useSIMDKernel
+    //
+    // ProcessStereoSIMD: the same kernel as WaveTableOsc::processBlockSIMD, but with lanes taken from
+    // every voice's notes rather than one voice's, so a wide unison on a single note fills the lanes too.
+    // Each lane is panned by its voice's gains, and left and right are reduced together. The gains only
+    // step frame by frame while the amplitude glides
+    //
+    template <bool ramp>
+    void processStereoSIMD(const waveTableBank* bank, float* outL, float* outR, int frames, int first, int end, const envelopeSegments& env) {
+        laneGroup group;
+        for (int start = first; start < end; start += noteLanes) {
+            gatherLanes(bank, start, end, frames, group);
+            const float* const* wave = group.wave;
+            const int* note = group.note;
+
+            __m128 gainL = _mm_loadu_ps(group.gainL);
+            __m128 gainR = _mm_loadu_ps(group.gainR);
+            const __m128 gainStepL = _mm_loadu_ps(group.gainStepL);
+            const __m128 gainStepR = _mm_loadu_ps(group.gainStepR);
+            lanePhases phases(group.phasor, group.phaseInc, group.len);
+
+            // each lane's envelope steps along its segment, and is gathered afresh at each envelope update
+            for (int seg = 0, n = 0; n < frames; seg++) {
+                const float* level = env.level[seg];
+                const float* step = env.step[seg];
+                __m128 envLevel = _mm_set_ps(level[note[3]], level[note[2]], level[note[1]], level[note[0]]);
+                const __m128 envStep = _mm_set_ps(step[note[3]], step[note[2]], step[note[1]], step[note[0]]);
+                const int segEnd = min(frames, n + env.length[seg]);
+
+                for (; n < segEnd; n++) {
+                    __m128 fracPart;
+                    alignas(16) int idx[noteLanes];
+                    _mm_store_si128((__m128i*)idx, phases.step(fracPart));
+
+                    __m128 samp0 = _mm_set_ps(wave[3][idx[3]], wave[2][idx[2]], wave[1][idx[1]], wave[0][idx[0]]);
+                    __m128 samp1 = _mm_set_ps(wave[3][idx[3] + 1], wave[2][idx[2] + 1], wave[1][idx[1] + 1], wave[0][idx[0] + 1]);
+                    __m128 samp = _mm_add_ps(samp0, _mm_mul_ps(_mm_sub_ps(samp1, samp0), fracPart));
+                    envLevel = _mm_add_ps(envLevel, envStep);
+                    samp = _mm_mul_ps(samp, envLevel);
+
+                    if (ramp && n < group.rampFrames) {
+                        gainL = _mm_add_ps(gainL, gainStepL);
+                        gainR = _mm_add_ps(gainR, gainStepR);
+                    }
+
+                    // [L0 L1 L2 L3] and [R0 R1 R2 R3] to [L R . .] in two adds
+                    __m128 left = _mm_mul_ps(samp, gainL);
+                    __m128 right = _mm_mul_ps(samp, gainR);
+                    __m128 pairs = _mm_add_ps(_mm_unpacklo_ps(left, right), _mm_unpackhi_ps(left, right));
+                    __m128 sums = _mm_add_ps(pairs, _mm_movehl_ps(pairs, pairs));
+                    outL[n] += _mm_cvtss_f32(sums);
+                    outR[n] += _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, _MM_SHUFFLE(1, 1, 1, 1)));
+                }
+            }
+
+            phases.store(group.phasor);
+            storePhases(group);
+        }
+    }
+#endif
+
+    // g for note slot p's filter at cutoff (log2 Hz), key tracked from the note's pitch
+    float noteFilterCoefficient(int p, float cutoff) const {
+        return filterCoefficient(exp2f(cutoff + mCutoffMod + filterKeyTrack * mKeyOctaves[p]));
+    }
+
+    //
+    // ProcessFiltered: the filter needs each note's whole unison sum, so notes are rendered noteLanes at a
+    // time with all of their voices. Counting noteLanes * voices note voices to such a group, each group is
+    // rendered by the range its first note voice falls in, so the RenderPool's ranges still share the work
+    //
+    void processFiltered(const waveTableBank* bank, float* outL, float* outR, int frames, int first, int end, const float* pitchRatio,
+        const envelopeSegments& env, filterSums& sums) {
+        const int notes = numActiveNotes();
+        const int groupVoices = noteLanes * voices;
+        for (int group = (first + groupVoices - 1) / groupVoices; group * groupVoices < end; group++) {
+            const int firstNote = group * noteLanes;
+            const int count = min(noteLanes, notes - firstNote);
+            int slot[noteLanes];
+            for (int lane = 0; lane < noteLanes; lane++) {
+                // spare lanes filter silence with slot 0's coefficient, and are never stored
+                slot[lane] = lane < count ? mOscillators[0].mActiveNotes[firstNote + lane] : 0;
+            }
+
+            float* sumL = sums.left;
+            float* sumR = sums.right;
+            fill(sumL, sumL + frames * noteLanes, 0.0f);
+            fill(sumR, sumR + frames * noteLanes, 0.0f);
+            for (int voice = 0; voice < voices; voice++) {
+                sumVoice(bank, voice, slot, count, frames, pitchRatio, sumL, sumR);
+            }
+            filterNotes(slot, count, frames, sumL, sumR, outL, outR, env);
+        }
+    }
+
+    // adds one unison voice of a group's notes, panned, into the group's sums
+    void sumVoice(const waveTableBank* bank, int voice, const int* slot, int count, int frames, const float* pitchRatio,
+        float* sumL, float* sumR) {
+        perNoteData& notes = mOscillators[voice].notes;
+        const float panL = mPanGains[voice][0];
+        const float panR = mPanGains[voice][1];
+#if useSIMDKernel
+        if (!pitchRatio) {
+            static const float silence[2] = { 0.0f, 0.0f };
+            const int lastLevel = (int)bank->levels.size() - 1;
+            const float* wave[noteLanes];
+            int len[noteLanes];
+            phaseAccumulator phasor[noteLanes];
+            phaseAccumulator phaseInc[noteLanes];
+            for (int lane = 0; lane < noteLanes; lane++) {
+                if (lane < count) {
+                    const waveTableLevel* thisTable = &bank->levels[min(notes.mCurWaveTable[slot[lane]], lastLevel)];
+                    wave[lane] = thisTable->samples;
+                    len[lane] = thisTable->waveTableLen;
+                    phasor[lane] = notes.mPhasor[slot[lane]];
+                    phaseInc[lane] = notes.mPhaseInc[slot[lane]];
+                } else {
+                    wave[lane] = silence;
+                    len[lane] = 0;
+                    phasor[lane] = 0;
+                    phaseInc[lane] = 0;
+                }
+            }
+
+            lanePhases phases(phasor, phaseInc, len);
+            const __m128 gainL = _mm_set1_ps(panL);
+            const __m128 gainR = _mm_set1_ps(panR);
+            for (int n = 0; n < frames; n++) {
+                __m128 fracPart;
+                alignas(16) int idx[noteLanes];
+                _mm_store_si128((__m128i*)idx, phases.step(fracPart));
+
+                __m128 samp0 = _mm_set_ps(wave[3][idx[3]], wave[2][idx[2]], wave[1][idx[1]], wave[0][idx[0]]);
+                __m128 samp1 = _mm_set_ps(wave[3][idx[3] + 1], wave[2][idx[2] + 1], wave[1][idx[1] + 1], wave[0][idx[0] + 1]);
+                __m128 samp = _mm_add_ps(samp0, _mm_mul_ps(_mm_sub_ps(samp1, samp0), fracPart));
+
+                float* left = sumL + n * noteLanes;
+                float* right = sumR + n * noteLanes;
+                _mm_store_ps(left, _mm_add_ps(_mm_load_ps(left), _mm_mul_ps(samp, gainL)));
+                _mm_store_ps(right, _mm_add_ps(_mm_load_ps(right), _mm_mul_ps(samp, gainR)));
+            }
+
+            phases.store(phasor);
+            for (int lane = 0; lane < count; lane++) {
+                notes.mPhasor[slot[lane]] = phasor[lane];
+            }
+            return;
+        }
+#endif
+        for (int lane = 0; lane < count; lane++) {
+            const int p = slot[lane];
+            const phaseAccumulator phaseInc = notes.mPhaseInc[p];
+            const double phaseIncCycles = phaseToCycles(phaseInc);
+            const waveTableLevel* thisTable = &bank->levels[levelForIncrement(bank, phaseIncCycles)];
+            phaseAccumulator phasor = notes.mPhasor[p];
+
+            for (int n = 0; n < frames; n++) {
+                phaseAccumulator inc = phaseInc;
+                if (pitchRatio) {
+                    const double cycles = phaseIncCycles * pitchRatio[n];
+                    thisTable = &bank->levels[levelForIncrement(bank, cycles)];
+                    inc = toPhase(cycles);
+                }
+
+                phasor = advancePhase(phasor, inc);
+                const float samp = lookupPhase(thisTable, phasor);
+                sumL[n * noteLanes + lane] += samp * panL;
+                sumR[n * noteLanes + lane] += samp * panR;
+            }
+
+            notes.mPhasor[p] = phasor;
+        }
+    }
+
+    // every lane's coefficient from the cutoff n frames into the block
+    void refreshFilterCoefficients(const int* slot, int count, int n) {
+        const float cutoff = filterCutoff.valueAfter(n);
+        for (int lane = 0; lane < count; lane++) {
+            mFilterG[slot[lane]] = noteFilterCoefficient(slot[lane], cutoff);
+        }
+    }
+
+    //
+    // FilterNotes: runs each lane's unison sums through its note's filter, scales them by the note's envelope,
+    // and adds the lanes into outL and outR at the stack amplitude. The coefficients are worked out afresh at
+    // every envelope update, from the cutoff on that frame
+    //
+    void filterNotes(const int* slot, int count, int frames, const float* sumL, const float* sumR, float* outL, float* outR,
+        const envelopeSegments& env) {
+        const float damping = filterDamping(filterResonance);
+        const filterMix mix(filterMode, damping);
+        const float startAmp = amplitude.current();
+        const float ampStep = amplitude.step();
+        const int rampFrames = amplitude.rampFrames(frames);
+
+#if useSIMDKernel
+        // left ic1, left ic2, right ic1, right ic2, by lane
+        alignas(16) float state[4][noteLanes];
+        for (int lane = 0; lane < noteLanes; lane++) {
+            for (int i = 0; i < 4; i++) {
+                state[i][lane] = lane < count ? mFilterState[slot[lane]][i] : 0.0f;
+            }
+        }
+        __m128 ic1L = _mm_load_ps(state[0]);
+        __m128 ic2L = _mm_load_ps(state[1]);
+        __m128 ic1R = _mm_load_ps(state[2]);
+        __m128 ic2R = _mm_load_ps(state[3]);
+        const __m128 one = _mm_set1_ps(1.0f);
+        const __m128 k = _mm_set1_ps(damping);
+        const __m128 m0 = _mm_set1_ps(mix.m0);
+        const __m128 m1 = _mm_set1_ps(mix.m1);
+        const __m128 m2 = _mm_set1_ps(mix.m2);
+
+        for (int seg = 0, n = 0; n < frames; seg++) {
+            if (env.update[seg]) {
+                refreshFilterCoefficients(slot, count, n);
+            }
+            const __m128 g = _mm_set_ps(mFilterG[slot[3]], mFilterG[slot[2]], mFilterG[slot[1]], mFilterG[slot[0]]);
+            const __m128 a1 = _mm_div_ps(one, _mm_add_ps(one, _mm_mul_ps(g, _mm_add_ps(g, k))));
+            const __m128 a2 = _mm_mul_ps(g, a1);
+            const __m128 a3 = _mm_mul_ps(g, a2);
+
+            const float* level = env.level[seg];
+            const float* step = env.step[seg];
+            __m128 envLevel = _mm_set_ps(level[slot[3]], level[slot[2]], level[slot[1]], level[slot[0]]);
+            const __m128 envStep = _mm_set_ps(step[slot[3]], step[slot[2]], step[slot[1]], step[slot[0]]);
+            const int segEnd = min(frames, n + env.length[seg]);
+
+            for (; n < segEnd; n++) {
+                envLevel = _mm_add_ps(envLevel, envStep);
+                __m128 left = svfTick(_mm_load_ps(sumL + n * noteLanes), ic1L, ic2L, a1, a2, a3, m0, m1, m2);
+                __m128 right = svfTick(_mm_load_ps(sumR + n * noteLanes), ic1R, ic2R, a1, a2, a3, m0, m1, m2);
+                left = _mm_mul_ps(left, envLevel);
+                right = _mm_mul_ps(right, envLevel);
+
+                // [L0 L1 L2 L3] and [R0 R1 R2 R3] to [L R . .] in two adds
+                __m128 pairs = _mm_add_ps(_mm_unpacklo_ps(left, right), _mm_unpackhi_ps(left, right));
+                __m128 sums = _mm_add_ps(pairs, _mm_movehl_ps(pairs, pairs));
+                const float gain = startAmp + ampStep * min(n + 1, rampFrames);
+                outL[n] += _mm_cvtss_f32(sums) * gain;
+                outR[n] += _mm_cvtss_f32(_mm_shuffle_ps(sums, sums, _MM_SHUFFLE(1, 1, 1, 1))) * gain;
+            }
+        }
+
+        _mm_store_ps(state[0], ic1L);
+        _mm_store_ps(state[1], ic2L);
+        _mm_store_ps(state[2], ic1R);
+        _mm_store_ps(state[3], ic2R);
+        for (int lane = 0; lane < count; lane++) {
+            for (int i = 0; i < 4; i++) {
+                mFilterState[slot[lane]][i] = state[i][lane];
+            }
+        }
+#else
+        for (int seg = 0, n = 0; n < frames; seg++) {
+            if (env.update[seg]) {
+                refreshFilterCoefficients(slot, count, n);
+            }
+            float a1[noteLanes], a2[noteLanes], a3[noteLanes], envLevel[noteLanes], envStep[noteLanes];
+            for (int lane = 0; lane < count; lane++) {
+                const float g = mFilterG[slot[lane]];
+                a1[lane] = 1.0f / (1.0f + g * (g + damping));
+                a2[lane] = g * a1[lane];
+                a3[lane] = g * a2[lane];
+                envLevel[lane] = env.level[seg][slot[lane]];
+                envStep[lane] = env.step[seg][slot[lane]];
+            }
+            const int segEnd = min(frames, n + env.length[seg]);
+
+            for (; n < segEnd; n++) {
+                float left = 0.0f, right = 0.0f;
+                for (int lane = 0; lane < count; lane++) {
+                    float* ic = mFilterState[slot[lane]];
+                    envLevel[lane] += envStep[lane];
+                    left += svfTick(sumL[n * noteLanes + lane], ic[0], ic[1], a1[lane], a2[lane], a3[lane], mix) * envLevel[lane];
+                    right += svfTick(sumR[n * noteLanes + lane], ic[2], ic[3], a1[lane], a2[lane], a3[lane], mix) * envLevel[lane];
+                }
+                const float gain = startAmp + ampStep * min(n + 1, rampFrames);
+                outL[n] += left * gain;
+                outR[n] += right * gain;
+            }
+        }
+#endif
+    }
+
     vector<WaveTableOsc> mOscillators;
+    sharedWaveTableBank mBank;
+    double mNoteFreqs[maxPolyphony];    // each note's normalised frequency before detune, 0 if silent
+    double mDetuneRatios[maxVoices];    // each voice's frequency multiplier for the current voices and unisonDetune
+    float mPanGains[maxVoices][2];      // each voice's left and right gain for the current voices, unisonSpread and pan
+    vector<float> mStackBuffer; // unison sum for one block, preallocated so the audio thread never allocates
+    vector<filterSums> mFilterSums; // one, for callers that do not pass their own
 
-    // spread of each voice (with max detune) in semitones from central note
-    vector<vector<double>> allDetuneSemitones = {
-    {0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-    {-1.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-    {-1.0, 0.0, 1.0, 0.0, 0.0, 0.0, 0.0, 0.0},
-    {-1.0, -1.0 / 3.0, 1.0 / 3.0, 1.0, 0.0, 0.0, 0.0, 0.0},
-    {-1.0, -0.5, 0.0, 0.5, 1.0, 0.0, 0.0, 0.0},
-    {-1.0, -0.6, -0.2, 0.2, 0.6, 1.0, 0.0, 0.0},
-    {-1.0, -2.0 / 3.0, -1.0 / 3.0, 0.0, 1.0 / 3.0, 2.0 / 3.0, 1.0, 0.0},
-    {-1.0, -1.0 + 2.0 / 7.0, -1.0 + 4.0 / 7.0, -1.0 + 6.0 / 7.0, 1.0 - 6.0 / 7.0, 1.0 - 4.0 / 7.0, 1.0 - 2.0 / 7.0, 1.0}
-    };
+    // per-note filter, by note slot
+    alignas(16) float mFilterState[maxPolyphony][4];   // integrator states: left ic1, ic2, right ic1, ic2
+    float mFilterG[maxPolyphony];       // coefficient, as of the last envelope update or the note's start
+    float mKeyOctaves[maxPolyphony];    // octaves from filterKeyCentre to the note
+
+    // modulation, as of the last setModulation
+    SmoothedParam mBaseAmplitude{ 0.5f };   // the amplitude as set, gliding
+    float mModGain = 1.0f;
+    float mDetuneMod = 0.0f;
+    float mPanMod = 0.0f;
+    float mCutoffMod = 0.0f;    // octaves
 };
 
-vector<vector<waveTable>> templateTables(numberOfShapes);
+// one read-only bank per shape, shared by every stack playing that shape
+vector<sharedWaveTableBank> templateTables(numberOfShapes);
 
 #define maxOscStacks (3)
 int numberOfOscStacks = 1;
 
-vector<WaveTableOscStack> oscStacks;
-
-void fft(int N, vector<myFloat>& ar, vector<myFloat>& ai);
-void defineSine(int len, vector<myFloat>& ar, vector<myFloat>& ai);
-void defineTriangle(int len, int numHarmonics, vector<myFloat>& ar, vector<myFloat>& ai);
-void defineSawtooth(int len, int numHarmonics, vector<myFloat>& ar, vector<myFloat>& ai);
-void defineSquare(int len, int numHarmonics, vector<myFloat>& ar, vector<myFloat>& ai);
-
-void makeAllTables(vector<vector<waveTable>>* allTables, float baseFreq);
-waveTable makeWaveTable(int len, vector<myFloat>& ar, vector<myFloat>& ai, double topFreq);
+vector<WaveTableOscStack> oscStacks(maxOscStacks);
 
 #endif
@@ -0,0 +1,271 @@
+#pragma once
+#include <stdint.h>
+#include "MIDI.h"
+
+// Assigns held keys to the oscillators' note slots. Up to maxPolyphony slots exist;
+// how many are in use is set at runtime. All storage is fixed size, so nothing is
+// allocated while playing, and looking up a key's slot is a single array read.
+//
+// Slots in use are kept in a list in the order their notes started, so the oldest
+// note is always at the head. When every slot is taken, a new note either replaces
+// the oldest or the quietest (lowest velocity, oldest first on a tie), or is dropped.
+//
+// With notesEnded set, a released slot is only free once the synth says its note has
+// finished sounding, release and all. Until then it is kept from new notes unless no
+// free slot is left, when the one released longest ago is taken before any held note.
+//
+// With noteRoom set, a change that needs more note messages than the synth can take
+// now is refused and changes nothing, so the synth never misses a note the allocator
+// has recorded.
+
+enum stealPolicy {
+	stealNone,
+	stealOldest,
+	stealQuietest,
+};
+
+class VoiceAllocator {
+public:
+	VoiceAllocator(int voices = defaultPolyphony) {
+		for (int k = 0; k < noOfMIDINotes + 1; k++) {
+			keySlot[k] = noSlot;
+		}
+		for (int s = 0; s < maxPolyphony; s++) {
+			slotKey[s] = midiNone;
+			slotVelocity[s] = 0.0f;
+			slotNotes[s] = 0;
+			prev[s] = next[s] = noSlot;
+		}
+		setVoiceCount(voices, [](int, int) {});
+	}
+
+	// the slot a new note plays in, noSlot if the key is already held or no slot can be had.
+	// A stolen slot simply gets the new key; the caller's note message overrides the old note.
+	int noteOn(int key, float velocity) {
+		if (key < 0 || key >= noOfMIDINotes || keySlot[key] != noSlot || !hasRoom(1)) {
+			return noSlot;
+		}
+		reclaim();
+		int slot = noSlot;
+		if (numFree > 0) {
+			slot = freeSlots[--numFree];
+		} else if (numReleasing > 0) {
+			slot = releasing[0];
+			removeReleasing(0);
+		} else if (policy == stealOldest) {
+			slot = oldest;
+		} else if (policy == stealQuietest) {
+			slot = oldest;
+			for (int s = next[oldest]; s != noSlot; s = next[s]) {
+				if (slotVelocity[s] < slotVelocity[slot]) {
+					slot = s;
+				}
+			}
+		}
+		if (slot == noSlot) {
+			return noSlot;
+		}
+		if (slotKey[slot] != midiNone) {
+			keySlot[slotKey[slot]] = noSlot;
+			unlink(slot);
+		}
+		keySlot[key] = slot;
+		slotKey[slot] = key;
+		slotVelocity[slot] = velocity;
+		slotNotes[slot]++;
+		append(slot);
+		return slot;
+	}
+
+	// the slot the key was playing in, noSlot if it was not held (or was stolen), or if there is
+	// no room for the note off, when the key stays held
+	int noteOff(int key) {
+		if (key < 0 || key >= noOfMIDINotes || keySlot[key] == noSlot || !hasRoom(1)) {
+			return noSlot;
+		}
+		int slot = keySlot[key];
+		release(slot);
+		return slot;
+	}
+
+	bool isKeyOn(int key) const {
+		return key >= 0 && key < noOfMIDINotes && keySlot[key] != noSlot;
+	}
+
+	int slotOfKey(int key) const {
+		return (key >= 0 && key < noOfMIDINotes) ? keySlot[key] : noSlot;
+	}
+
+	int keyInSlot(int slot) const {
+		return slotKey[slot];
+	}
+
+	// held notes
+	int activeCount() const {
+		return voiceCount - numFree - numReleasing;
+	}
+
+	// released notes still sounding, as far as is known
+	int releasingCount() const {
+		return numReleasing;
+	}
+
+	int getVoiceCount() const {
+		return voiceCount;
+	}
+
+	// silence(key, slot) is called for every note dropped because its slot is no longer in use;
+	// false, changing nothing, if there is no room for those
+	template <typename F>
+	bool setVoiceCount(int voices, F silence) {
+		voices = voices < 1 ? 1 : (voices > maxPolyphony ? maxPolyphony : voices);
+		int dropped = 0;
+		for (int s = voices; s < voiceCount; s++) {
+			dropped += slotKey[s] != midiNone;
+		}
+		if (!hasRoom(dropped)) {
+			return false;
+		}
+		for (int s = voices; s < voiceCount; s++) {
+			if (slotKey[s] != midiNone) {
+				silence(slotKey[s], s);
+				releaseSlot(s);
+			}
+		}
+		for (int r = numReleasing - 1; r >= 0; r--) {
+			if (releasing[r] >= voices) {
+				removeReleasing(r);
+			}
+		}
+		voiceCount = voices;
+		// rebuilt so the lowest free slot is taken first
+		numFree = 0;
+		for (int s = voiceCount - 1; s >= 0; s--) {
+			if (slotKey[s] == midiNone && !isReleasing(s)) {
+				freeSlots[numFree++] = s;
+			}
+		}
+		return true;
+	}
+
+	// silence(key, slot) for every held note, then frees them all; false, changing nothing, if
+	// there is no room for the note offs
+	template <typename F>
+	bool releaseAll(F silence) {
+		if (!hasRoom(activeCount())) {
+			return false;
+		}
+		while (oldest != noSlot) {
+			int slot = oldest;
+			silence(slotKey[slot], slot);
+			release(slot);
+		}
+		return true;
+	}
+
+	// moves released slots whose notes have ended to the free list; noteOn does this itself
+	void reclaim() {
+		if (notesEnded == nullptr) {
+			return;
+		}
+		for (int r = 0; r < numReleasing;) {
+			int slot = releasing[r];
+			if (notesEnded(slot) == slotNotes[slot]) {
+				removeReleasing(r);
+				freeSlots[numFree++] = slot;
+			} else {
+				r++;
+			}
+		}
+	}
+
+	stealPolicy policy = stealOldest;
+
+	// how many of the notes started in a slot have finished sounding, as counted by the synth
+	// (one for each note noteOn gave the slot); nullptr frees slots as soon as they are released
+	uint32_t (*notesEnded)(int slot) = nullptr;
+
+	// how many more note messages the synth can take now; nullptr for always enough
+	int (*noteRoom)() = nullptr;
+
+	static const int noSlot = -1;
+
+protected:
+	bool hasRoom(int messages) const {
+		return messages == 0 || noteRoom == nullptr || noteRoom() >= messages;
+	}
+
+	void release(int slot) {
+		releaseSlot(slot);
+		if (notesEnded != nullptr) {
+			releasing[numReleasing++] = slot;
+		} else {
+			freeSlots[numFree++] = slot;
+		}
+	}
+
+	bool isReleasing(int slot) const {
+		for (int r = 0; r < numReleasing; r++) {
+			if (releasing[r] == slot) {
+				return true;
+			}
+		}
+		return false;
+	}
+
+	void removeReleasing(int r) {
+		for (; r < numReleasing - 1; r++) {
+			releasing[r] = releasing[r + 1];
+		}
+		numReleasing--;
+	}
+
+	// without returning the slot to the free list
+	void releaseSlot(int slot) {
+		keySlot[slotKey[slot]] = noSlot;
+		slotKey[slot] = midiNone;
+		unlink(slot);
+	}
+
+	void append(int slot) {
+		prev[slot] = newest;
+		next[slot] = noSlot;
+		if (newest != noSlot) {
+			next[newest] = slot;
+		} else {
+			oldest = slot;
+		}
+		newest = slot;
+	}
+
+	void unlink(int slot) {
+		if (prev[slot] != noSlot) {
+			next[prev[slot]] = next[slot];
+		} else {
+			oldest = next[slot];
+		}
+		if (next[slot] != noSlot) {
+			prev[next[slot]] = prev[slot];
+		} else {
+			newest = prev[slot];
+		}
+		prev[slot] = next[slot] = noSlot;
+	}
+
+	int voiceCount = 0;
+	int keySlot[noOfMIDINotes + 1];		// slot each key plays in, or noSlot
+	int slotKey[maxPolyphony];			// key each slot plays, or midiNone
+	float slotVelocity[maxPolyphony];
+	uint32_t slotNotes[maxPolyphony];	// notes started in each slot
+	int freeSlots[maxPolyphony];		// stack of free slots below voiceCount
+	int numFree = 0;
+	int releasing[maxPolyphony];		// released slots that may still be sounding, in the order they were released
+	int numReleasing = 0;
+	int prev[maxPolyphony];				// start order list of the slots in use
+	int next[maxPolyphony];
+	int oldest = noSlot;
+	int newest = noSlot;
+};
+
+// the keyboard's notes, shared by the piano widget and the rest of the GUI; defined once, by the application
+extern VoiceAllocator voiceAllocator;
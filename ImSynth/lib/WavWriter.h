@@ -0,0 +1,98 @@
+#pragma once
+#include <stdio.h>
+#include <stdint.h>
+#include <math.h>
+
+// Streams interleaved float samples to a RIFF/WAVE file, as 32 bit float or 16 bit PCM.
+// The header is written up front and its sizes patched in close().
+class WavWriter {
+public:
+	~WavWriter() {
+		close();
+	}
+
+	bool open(const char* path, int sampleRateHz, int channelCount, bool floatFormat) {
+		file = fopen(path, "wb");
+		if (file == NULL) {
+			return false;
+		}
+		channels = channelCount;
+		isFloat = floatFormat;
+		dataBytes = 0;
+
+		int bytesPerSample = isFloat ? 4 : 2;
+		fwrite("RIFF", 1, 4, file);
+		writeU32(0);							// patched in close()
+		fwrite("WAVE", 1, 4, file);
+		fwrite("fmt ", 1, 4, file);
+		writeU32(16);
+		writeU16(isFloat ? 3 : 1);				// WAVE_FORMAT_IEEE_FLOAT or WAVE_FORMAT_PCM
+		writeU16(channels);
+		writeU32(sampleRateHz);
+		writeU32(sampleRateHz * channels * bytesPerSample);
+		writeU16(channels * bytesPerSample);
+		writeU16(bytesPerSample * 8);
+		fwrite("data", 1, 4, file);
+		writeU32(0);							// patched in close()
+		return true;
+	}
+
+	// frames of interleaved samples, channels per frame
+	bool write(const float* samples, unsigned long frames) {
+		if (file == NULL) {
+			return false;
+		}
+		unsigned long count = frames * channels;
+		if (isFloat) {
+			if (fwrite(samples, sizeof(float), count, file) != count) {
+				return false;
+			}
+			dataBytes += count * 4;
+		} else {
+			// convert in chunks so the file sees one write per chunk (little-endian hosts only, as for the float path)
+			int16_t pcm[1024];
+			for (unsigned long done = 0; done < count; ) {
+				unsigned long chunk = count - done < 1024 ? count - done : 1024;
+				for (unsigned long n = 0; n < chunk; n++) {
+					float s = samples[done + n];
+					s = s > 1.0f ? 1.0f : (s < -1.0f ? -1.0f : s);
+					pcm[n] = (int16_t)lrintf(s * 32767.0f);
+				}
+				if (fwrite(pcm, sizeof(int16_t), chunk, file) != chunk) {
+					return false;
+				}
+				done += chunk;
+			}
+			dataBytes += count * 2;
+		}
+		return true;
+	}
+
+	void close() {
+		if (file == NULL) {
+			return;
+		}
+		fseek(file, 4, SEEK_SET);
+		writeU32((uint32_t)(36 + dataBytes));
+		fseek(file, 40, SEEK_SET);
+		writeU32((uint32_t)dataBytes);
+		fclose(file);
+		file = NULL;
+	}
+
+private:
+	void writeU16(uint16_t v) {
+		unsigned char b[2] = { (unsigned char)v, (unsigned char)(v >> 8) };
+		fwrite(b, 1, 2, file);
+	}
+
+	void writeU32(uint32_t v) {
+		unsigned char b[4] = { (unsigned char)v, (unsigned char)(v >> 8), (unsigned char)(v >> 16), (unsigned char)(v >> 24) };
+		fwrite(b, 1, 4, file);
+	}
+
+	FILE* file = NULL;
+	int channels = 2;
+	bool isFloat = true;
+	uint64_t dataBytes = 0;
+};
@@ -21,7 +21,12 @@
 #include "portaudio.h"
 
 #include "lib/MIDI.h"
-#include "lib/Synth/WaveTableOscPoly.h"
+#include "lib/Synth/SynthEngine.h"
+#include "lib/Synth/LoadMeter.h"
+#include "lib/Synth/WaveTableCache.h"
+#include "lib/Synth/SpectrumAnalyzer.h"
+#include "lib/Synth/TripleBuffer.h"
+#include "lib/MidiPlayer.h"
 
 //temp
 #include <map>
@@ -40,9 +45,20 @@ static void glfw_error_callback(int error, const char* description)
     #define M_PI  (3.14159265)
 #endif
 
-bool soundOn = true;
 float gAmplitude = 0.02f;
+float gPitchBend = 0.0f;
+float gVibratoRate = 5.0f;
+float gVibratoDepth = 0.0f;
+adsrSettings gEnvelope;     // GUI copy; changes reach the audio thread through commandQueue
+
+// GUI copies of the LFOs and modulation matrix
+int gControlInterval = defaultControlInterval;
+int gLfoWave[numberOfLFOs] = {};
+float gLfoRate[numberOfLFOs] = { 1.0f, 1.0f };
+float gModDepth[numberOfLFOs][maxOscStacks][numberOfModDestinations] = {};
+int renderThreads = 1;  // threads rendering each block, the audio thread included
 unsigned int audioOutChannels = 2;
+VoiceAllocator voiceAllocator;
 
 //bool holdNote = false;
 //bool retrig = false;
@@ -50,25 +66,200 @@ unsigned int audioOutChannels = 2;
 //int prevNoteActive = midiNone;
 //int prevNote = midiNone;
 
-void pushFreq(int key, int noteIndex)
+// GUI copies of the stack parameters; changes reach the audio thread through commandQueue
+struct stackControls {
+    int     shape = 0;
+    int     voices = 1;
+    float   unisonDetune = 0.0;
+    float   unisonSpread = 100.0;
+    float   pan = 0.0;
+    float   amplitude = 0.5;
+    int     filterMode = filterOff;
+    float   filterCutoff = filterMaxCutoff;     // Hz
+    float   filterResonance = 0.0;
+    float   filterKeyTrack = 0.0;
+};
+
+stackControls oscControls[maxOscStacks];
+
+// Note timing: piano events are stamped with the stream clock as GLFW reports them, and are
+// heard a constant inputLatency after that, on the exact frame, rather than whenever the next
+// GUI frame and then the next audio block happen to come round. The audio callback publishes
+// which engine frame reaches the DAC when, for the GUI to work out that frame from
+struct audioClock {
+    uint64_t frame = 0;     // engine frame at the start of the latest block
+    double dacTime = 0.0;   // stream time that frame reaches the DAC; 0 when the host API does not say
+    double latency = 0.0;   // from the start of a callback to the end of its block reaching the DAC
+};
+TripleBuffer<audioClock> audioClocks;
+PaStream* stream = NULL;
+bool timedInput = true;
+float inputSlack = 5.0f;    // ms for the GUI to pass an event on, on top of the audio latency
+float inputLatency = 0.0f;  // ms, as last worked out, for the Global window
+
+static double inputClock()
 {
-    for (int i = 0; i < numberOfOscStacks; i++) {
-        oscStacks[i].setFrequencies(midiPitches[key] / SAMPLE_RATE, noteIndex);
+    return stream != NULL ? Pa_GetStreamTime(stream) : 0.0;
+}
+
+// the engine frame to apply an event from stream time eventTime at; 0 (the next block) without a clock
+static uint64_t inputFrame(double eventTime)
+{
+    audioClocks.update();
+    const audioClock& clock = audioClocks.front();
+    if (!timedInput || eventTime <= 0.0 || clock.dacTime <= 0.0) {
+        return 0;
+    }
+    // an event just after a callback started waits a block for the next one, and is still in time for its first frame
+    const double latency = clock.latency + inputSlack * 0.001;
+    inputLatency = (float)(latency * 1000.0);
+    const double frame = clock.frame + (eventTime + latency - clock.dacTime) * SAMPLE_RATE;
+    // too late (the GUI was held up) or absurdly early (the clock jumped): as soon as possible
+    if (frame <= (double)clock.frame || frame > (double)clock.frame + SAMPLE_RATE) {
+        return 0;
     }
+    return (uint64_t)(frame + 0.5);
 }
 
-void pushAllFreqs()
+static void keyCallback(GLFWwindow* window, int key, int scancode, int action, int mods)
 {
-    for (int i = 0; i < keyBuffer.size(); i++) {
-        pushFreq(keyBuffer[i], i);
+    if (action != GLFW_REPEAT && key >= 0 && key < IM_ARRAYSIZE(keyEventTime)) {
+        keyEventTime[key] = inputClock();
+    }
+}
+
+static void mouseButtonCallback(GLFWwindow* window, int button, int action, int mods)
+{
+    mouseEventTime = inputClock();
+}
+
+// dragging across the keyboard changes note without a button event
+static void cursorPosCallback(GLFWwindow* window, double x, double y)
+{
+    mouseEventTime = inputClock();
+}
+
+// only ever called for a note the allocator has made room for, so the push cannot fail
+void pushFreq(int key, int noteIndex, double time)
+{
+    sendNote(noteIndex, key, midiPitches[key] / SAMPLE_RATE, inputFrame(time));
+}
+
+// MIDI file playback: notes are handed to the engine midiLookahead ahead of the audio,
+// stamped with the frame they are due at
+#define midiLookahead (0.1)     // seconds
+MidiPlayer midiPlayer;
+shared_ptr<const midiSong> loadedSong;
+char midiPath[1024] = "";
+string midiStatus = "No file loaded; drop one on the window";
+
+// same slot handling as pianoCallback; velocity 0 is a note off
+void playerNote(int key, float velocity, uint64_t frame)
+{
+    if (velocity > 0.0f) {
+        int slot = voiceAllocator.noteOn(key, velocity);
+        if (slot != VoiceAllocator::noSlot) {
+            sendNote(slot, key, midiPitches[key] / SAMPLE_RATE, frame);
+        }
+    } else {
+        int slot = voiceAllocator.noteOff(key);
+        if (slot != VoiceAllocator::noSlot) {
+            sendNote(slot, key, 0.0, frame);
+        }
+    }
+}
+
+// for midiPlayer.schedule: takes the note only while the command queue has room for it with
+// noOfMIDINotes to spare, for the note offs from midiPlayer.stop; otherwise the player hands it
+// out again next GUI frame. Nothing else pushes in between, so the allocator never records a lost note
+bool scheduledNote(int key, float velocity, uint64_t frame)
+{
+    if (commandQueue.space() <= noOfMIDINotes) {
+        return false;
+    }
+    playerNote(key, velocity, frame);
+    return true;
+}
+
+void loadSong(const char* path)
+{
+    auto song = make_shared<midiSong>();
+    if (!loadMidiFile(path, *song, SAMPLE_RATE)) {
+        midiStatus = string("Cannot load ") + path;
+        return;
+    }
+    midiPlayer.stop(playerNote);
+    loadedSong = song;
+    char text[128];
+    snprintf(text, sizeof(text), "%d notes, %.1f s", song->notes, (double)song->lengthFrames / SAMPLE_RATE);
+    midiStatus = text;
+}
+
+static void dropCallback(GLFWwindow* window, int count, const char** paths)
+{
+    if (count > 0) {
+        snprintf(midiPath, sizeof(midiPath), "%s", paths[0]);
+        loadSong(midiPath);
     }
 }
 
 // Oscilloscope stuff
-int scopeBufferSize = SAMPLE_BUFFER_SIZE;
-vector<double> scopeIndex(scopeBufferSize, 0.0f);
-vector<double> scopeBuffer(scopeBufferSize, 0.0f);
-int scopePointer = 0;
+#define scopeMaxPoints (1024)   // longer windows are drawn as min/max per point
+ScopeTrace scopeTrace;
+float scopeTime = 10.0f;        // ms
+bool scopeTrigger = true;
+
+// Spectrum analyser, on its own thread, of the same tap
+SpectrumAnalyzer<outputTapSize> spectrumAnalyzer(outputTap);
+vector<float> spectrumFrequencies(spectrumBins, 0.0f);
+bool spectrumLogFrequency = true;
+bool showSpectrogram = false;
+
+// callback load against the buffer deadline, and PortAudio underflows
+LoadMeter dspLoad;
+
+// GUI redraw pacing. When eventDrivenGui is set the main loop sleeps in glfwWaitEventsTimeout
+// between frames: input wakes it at once, and otherwise it redraws at monitorFrameRate while
+// something sounding is on show (oscilloscope, spectrum or DSP meter) and at idleFrameRate
+// when not. A change in the audio state (sound starting or stopping, an xrun) also wakes it
+bool eventDrivenGui = true;
+int idleFrameRate = 4;
+int monitorFrameRate = 30;
+#define framesAfterInput (3)        // drawn straight after input, so ImGui's hover and active states catch up
+#define audioStateInterval (0.05)   // seconds between checks of the audio state while waiting
+
+static unsigned int audioState() {
+    return (engineSounding.load(memory_order_relaxed) ? 1u : 0u) | (dspLoad.xruns() << 1);
+}
+
+static void waitForNextFrame(double interval) {
+    static double lastFrame = 0.0;
+    static int pendingFrames = 0;
+
+    if (!eventDrivenGui || pendingFrames > 0) {
+        pendingFrames = max(0, pendingFrames - 1);
+        glfwPollEvents();
+        lastFrame = glfwGetTime();
+        return;
+    }
+
+    const double nextFrame = lastFrame + interval;
+    const unsigned int state = audioState();
+    for (double now = glfwGetTime(); now < nextFrame; now = glfwGetTime()) {
+        double timeout = min(nextFrame - now, audioStateInterval);
+        glfwWaitEventsTimeout(timeout);
+        // back before the timeout: an event, which may be input
+        if (glfwGetTime() - now < timeout) {
+            pendingFrames = framesAfterInput;
+            break;
+        }
+        if (audioState() != state) {
+            break;
+        }
+    }
+    glfwPollEvents();
+    lastFrame = glfwGetTime();
+}
 
 static int Render_Audio(const void* inputBuffer,
     void* outputBuffer,
@@ -77,27 +268,22 @@ static int Render_Audio(const void* inputBuffer,
     PaStreamCallbackFlags           statusFlags,
     void* userData)
 {
-    float* out = (float*)outputBuffer;
     (void)inputBuffer; /* Prevent unused argument warning. */
 
-    for (unsigned int n = 0; n < framesPerBuffer; n++) {
-        double sample = 0.0;
+    auto start = dspLoad.beginCallback();
+    if (statusFlags & paOutputUnderflow) {
+        dspLoad.countXrun();
+    }
+
+    audioClock& clock = audioClocks.back();
+    clock.frame = engineFrame.load(memory_order_relaxed);
+    clock.dacTime = timeInfo->outputBufferDacTime;
+    clock.latency = (timeInfo->currentTime > 0.0 ? clock.dacTime - timeInfo->currentTime : 0.0) + (double)framesPerBuffer / SAMPLE_RATE;
+    audioClocks.publish();
 
-        if (soundOn) {
-            for (int n = 0; n < numberOfOscStacks; n++) {
-                sample += oscStacks[n].processAll();
-            }
-            sample *= gAmplitude;
-        } else {
-            sample = 0.0;
-        }
-        scopeBuffer[scopePointer] = sample;
-        scopePointer = (scopePointer + 1) % scopeBufferSize;
+    renderBlock((float*)outputBuffer, framesPerBuffer, audioOutChannels);
 
-        for (unsigned int channel = 0; channel < audioOutChannels; channel++) {
-            *out++ = sample;
-        }
-    }
+    dspLoad.endCallback(start, (double)framesPerBuffer / SAMPLE_RATE);
     return 0;
 }
 
@@ -119,6 +305,11 @@ int main(void)
     GLFWwindow* window = glfwCreateWindow(1280, 720, "ImSynth pre-alpha", NULL, NULL);
     if (window == NULL) return 1;
     glfwSetWindowSizeLimits(window, 1080, 720, 1080, 720);
+    glfwSetDropCallback(window, dropCallback);
+    // set before ImGui's, which pass events on to them
+    glfwSetKeyCallback(window, keyCallback);
+    glfwSetMouseButtonCallback(window, mouseButtonCallback);
+    glfwSetCursorPosCallback(window, cursorPosCallback);
     glfwMakeContextCurrent(window);
     glfwSwapInterval(1); // Enable vsync
 
@@ -147,26 +338,50 @@ int main(void)
     // Our state
     bool showOscillators = true;
     bool showGlobal = true;
+    bool showMidiFile = false;
+    bool showModulation = false;
     bool showKeyboard = true;
     bool showOscilloscope = true;
+    bool showSpectrum = false;
+    bool monitoring = false;    // the last frame showed something that moves with the sound
     ImVec4 clear_color = ImVec4(0.24f, 0.35f, 0.56f, 1.00f);
 
-    // Initialise oscillator wavetable templates
-    makeAllTables(&templateTables, baseFrequency);
+    // Initialise oscillator wavetable templates, from the cache file when there is one
+    loadOrMakeAllTables(&templateTables, baseFrequency);
 
-    // Initialise oscillator stacks
+    // Initialise oscillator stacks, before the audio thread starts
     for (int n = 0; n < maxOscStacks; n++) {
-        WaveTableOscStack* stack = new WaveTableOscStack();
-        (*stack).setAllTables(&templateTables[0]);
-        oscStacks.push_back(*stack);
+        oscStacks[n].setAllTables(templateTables[oscControls[n].shape]);
+        oscStacks[n].setVoices(oscControls[n].voices);
+        oscStacks[n].setDetune(oscControls[n].unisonDetune);
+        oscStacks[n].setSpread(oscControls[n].unisonSpread);
+        oscStacks[n].setPan(oscControls[n].pan);
+        oscStacks[n].setAmplitude(oscControls[n].amplitude);
+        oscStacks[n].setFilterMode(oscControls[n].filterMode);
+        oscStacks[n].setFilterCutoff(oscControls[n].filterCutoff);
+        oscStacks[n].filterResonance = oscControls[n].filterResonance;
+        oscStacks[n].filterKeyTrack = oscControls[n].filterKeyTrack;
     }
+    engine.numberOfOscStacks = numberOfOscStacks;
+    engine.amplitude.reset(gAmplitude);
+    envelopes.setSettings(gEnvelope);
+    // released slots stay taken until their envelopes have finished
+    voiceAllocator.notesEnded = notesEnded;
+    // and notes are only given slots while their messages will fit in the command queue
+    voiceAllocator.noteRoom = []() { return (int)commandQueue.space(); };
+
+    // blocked until more than one render thread is chosen in the Global window
+    renderPool.start((int)thread::hardware_concurrency() - 1);
+
+    for (int k = 0; k < spectrumBins; k++) {
+        spectrumFrequencies[k] = spectrumAnalyzer.binFrequency(k, SAMPLE_RATE);
+    }
+    spectrumAnalyzer.setEnabled(false);
+    spectrumAnalyzer.start();
 
     initMidiPitches();
 
-    iota(begin(scopeIndex), end(scopeIndex), 0);
-
     PaStreamParameters outputParameters;
-    PaStream* stream;
     PaError err;
 
     err = Pa_Initialize();
@@ -204,7 +419,14 @@ int main(void)
         // - When io.WantCaptureMouse is true, do not dispatch mouse input data to your main application.
         // - When io.WantCaptureKeyboard is true, do not dispatch keyboard input data to your main application.
         // Generally you may always pass all inputs to dear imgui, and hide them from your application based on those two flags.
-        glfwPollEvents();
+        double frameInterval = 1.0 / (monitoring ? monitorFrameRate : idleFrameRate);
+        if (midiPlayer.isPlaying()) {
+            // often enough to stay ahead of the audio with the notes
+            frameInterval = min(frameInterval, midiLookahead / 4.0);
+        }
+        waitForNextFrame(frameInterval);
+
+        midiPlayer.schedule(engineFrame.load(memory_order_relaxed) + (uint64_t)(midiLookahead * SAMPLE_RATE), commandQueueSize / 2, scheduledNote);
 
         // Start the Dear ImGui frame
         ImGui_ImplOpenGL3_NewFrame();
@@ -218,7 +440,10 @@ int main(void)
             ImGui::Checkbox("Oscillators", &showOscillators);
             ImGui::Checkbox("Keyboard", &showKeyboard);
             ImGui::Checkbox("Oscilloscope", &showOscilloscope);
+            ImGui::Checkbox("Spectrum", &showSpectrum);
             ImGui::Checkbox("Global", &showGlobal);
+            ImGui::Checkbox("MIDI file", &showMidiFile);
+            ImGui::Checkbox("Modulation", &showModulation);
 
             ImGui::End();
         }
@@ -227,40 +452,61 @@ int main(void)
             ImGui::Begin("Oscillators", NULL, ImGuiWindowFlags_AlwaysAutoResize);
 
             if (ImGui::SliderInt("Osc count", &numberOfOscStacks, 1, 3, "%d")) {
-                pushAllFreqs();
+                sendCommand(cmdStackCount, 0, numberOfOscStacks);
             }
 
             const char* waveShape[] = {"Sine", "Triangle", "Saw", "Square" };
+            const char* filterModes[] = { "Off", "Low pass", "Band pass", "High pass" };
 
             for (int n = 0; n < numberOfOscStacks; n++) {
                 ImGui::PushID(n);
 
                 ImGui::Text("Osc %u", n + 1);
-                if (ImGui::Combo("Shape", &oscStacks[n].shape, waveShape, IM_ARRAYSIZE(waveShape))) {
-                    oscStacks[n].setAllTables(&templateTables[oscStacks[n].shape]);
-                    //pushAllFreqs();
+                if (ImGui::Combo("Shape", &oscControls[n].shape, waveShape, IM_ARRAYSIZE(waveShape))) {
+                    sendCommand(cmdShape, n, oscControls[n].shape);
                 }
-                if (ImGui::SliderInt("Voices", &oscStacks[n].voices, 1, 8, "%d")) {
-                    pushAllFreqs(); // because the detune frequencies have changed
+                if (ImGui::SliderInt("Voices", &oscControls[n].voices, 1, maxVoices, "%d")) {
+                    sendCommand(cmdVoices, n, oscControls[n].voices); // the stack re-detunes its notes itself
                 }
-                if (ImGui::SliderFloat("Detune", &oscStacks[n].unisonDetune, 0.0, 100.0)) {
-                    pushAllFreqs();
+                if (ImGui::SliderFloat("Detune", &oscControls[n].unisonDetune, 0.0, 100.0)) {
+                    sendCommand(cmdDetune, n, 0, oscControls[n].unisonDetune);
+                }
+                if (ImGui::SliderFloat("Spread", &oscControls[n].unisonSpread, 0.0, 100.0)) {
+                    sendCommand(cmdSpread, n, 0, oscControls[n].unisonSpread);
+                }
+                if (ImGui::SliderFloat("Pan", &oscControls[n].pan, -100.0, 100.0)) {
+                    sendCommand(cmdPan, n, 0, oscControls[n].pan);
+                }
+                if (ImGui::SliderFloat("Amp", &oscControls[n].amplitude, 0.0, 1.0)) {
+                    sendCommand(cmdAmplitude, n, 0, oscControls[n].amplitude);
+                }
+                if (ImGui::Combo("Filter", &oscControls[n].filterMode, filterModes, IM_ARRAYSIZE(filterModes))) {
+                    sendCommand(cmdFilterMode, n, oscControls[n].filterMode);
+                }
+                if (oscControls[n].filterMode != filterOff) {
+                    if (ImGui::SliderFloat("Cutoff", &oscControls[n].filterCutoff, filterMinCutoff, filterMaxCutoff, "%.0f Hz", ImGuiSliderFlags_Logarithmic)) {
+                        sendCommand(cmdFilterCutoff, n, 0, oscControls[n].filterCutoff);
+                    }
+                    if (ImGui::SliderFloat("Resonance", &oscControls[n].filterResonance, 0.0, 1.0)) {
+                        sendCommand(cmdFilterResonance, n, 0, oscControls[n].filterResonance);
+                    }
+                    if (ImGui::SliderFloat("Key track", &oscControls[n].filterKeyTrack, 0.0, 1.0)) {
+                        sendCommand(cmdFilterKeyTrack, n, 0, oscControls[n].filterKeyTrack);
+                    }
                 }
-
-                ImGui::SliderFloat("Amp", &oscStacks[n].amplitude, 0.0, 1.0);
 
                 ImGui::PopID();
             }
 
             if (ImGui::Button("Reset phase")) {
                 for (int n = 0; n < numberOfOscStacks; n++) {
-                    oscStacks[n].resetAllPhases();
+                    sendCommand(cmdResetPhases, n);
                 }
             }
             ImGui::SameLine();
             if (ImGui::Button("Randomise phase")) {
                 for (int n = 0; n < numberOfOscStacks; n++) {
-                    oscStacks[n].randomiseAllPhases();
+                    sendCommand(cmdRandomisePhases, n);
                 }
             }
 
@@ -276,22 +522,35 @@ int main(void)
         } else {
         }
 
+        bool scopeVisible = false;
         if (showOscilloscope) {
-            ImGui::SetNextWindowSize(ImVec2(400, 160), ImGuiCond_Once);
+            ImGui::SetNextWindowSize(ImVec2(400, 190), ImGuiCond_Once);
 
             if (ImGui::Begin("Oscilloscope")) { // needed otherwise will crash upon minimising
+                scopeVisible = true;
 
                 float scale = 0.0;
                 for (int n = 0; n < numberOfOscStacks; n++) {
-                    scale += (oscStacks[n].amplitude * oscStacks[n].voices);
+                    scale += (oscControls[n].amplitude * oscControls[n].voices);
                 }
 
-                ImPlot::SetNextPlotLimitsX(0.0, (float)SAMPLE_BUFFER_SIZE - 1.0, ImGuiCond_Always);
+                ImGui::SetNextItemWidth(200);
+                ImGui::SliderFloat("Time", &scopeTime, 1.0f, 500.0f, "%.1f ms", ImGuiSliderFlags_Logarithmic);
+                ImGui::SameLine();
+                ImGui::Checkbox("Trigger", &scopeTrigger);
+                scopeTrace.capture(outputTap, (int)(scopeTime * SAMPLE_RATE / 1000.0f), scopeMaxPoints, scopeTrigger, SAMPLE_RATE);
+
+                ImPlot::SetNextPlotLimitsX(0.0, scopeTime / 1000.0f, ImGuiCond_Always);
                 ImPlot::SetNextPlotLimitsY(-gAmplitude * scale, gAmplitude * scale, ImGuiCond_Always);
-                ImPlot::SetNextLineStyle(ImVec4(0, 0, 0, -1), 3.0f);
                 if (ImPlot::BeginPlot("", 0, 0, ImVec2(-1, -1), ImPlotFlags_AntiAliased, ImPlotAxisFlags_NoLabel | ImPlotAxisFlags_NoTickLabels,
                     ImPlotAxisFlags_NoLabel | ImPlotAxisFlags_NoTickLabels)) {
-                    ImPlot::PlotLine("", &scopeIndex[0], &scopeBuffer[0], SAMPLE_BUFFER_SIZE);
+                    if (scopeTrace.points > 0 && scopeTrace.samplesPerPoint == 1) {
+                        ImPlot::SetNextLineStyle(ImVec4(0, 0, 0, -1), 3.0f);
+                        ImPlot::PlotLine("", &scopeTrace.times[0], &scopeTrace.maximum[0], scopeTrace.points);
+                    } else if (scopeTrace.points > 0) {
+                        // decimated: the band each point's samples cover
+                        ImPlot::PlotShaded("", &scopeTrace.times[0], &scopeTrace.minimum[0], &scopeTrace.maximum[0], scopeTrace.points);
+                    }
                     ImPlot::EndPlot();
                 }
             }
@@ -299,11 +558,104 @@ int main(void)
             ImGui::End();
         }
 
+        // the analyser thread idles while there is nothing to show
+        bool spectrumVisible = false;
+        if (showSpectrum) {
+            ImGui::SetNextWindowSize(ImVec2(400, 240), ImGuiCond_Once);
+
+            if (ImGui::Begin("Spectrum")) {
+                spectrumVisible = true;
+                ImGui::Checkbox("Log frequency", &spectrumLogFrequency);
+                ImGui::SameLine();
+                ImGui::Checkbox("Spectrogram", &showSpectrogram);
+
+                spectrumAnalyzer.update();
+                const spectrumFrame& frame = spectrumAnalyzer.latest();
+                const float nyquist = SAMPLE_RATE / 2.0f;
+                float plotHeight = showSpectrogram ? ImGui::GetContentRegionAvail().y * 0.5f : -1.0f;
+
+                // bin 0 is left out of the log scale
+                ImPlot::SetNextPlotLimits(spectrumLogFrequency ? baseFrequency : 0.0, nyquist, spectrumFloor, 0.0, ImGuiCond_Always);
+                if (ImPlot::BeginPlot("", 0, 0, ImVec2(-1, plotHeight), ImPlotFlags_NoLegend | ImPlotFlags_NoMenus,
+                    spectrumLogFrequency ? ImPlotAxisFlags_LogScale : 0, 0)) {
+                    ImPlot::PlotLine("", &spectrumFrequencies[1], &frame.magnitude[1], spectrumBins - 1);
+                    ImPlot::EndPlot();
+                }
+
+                if (showSpectrogram) {
+                    // newest frame at the top, time running down
+                    const double history = spectrogramRows * (spectrumFftSize / spectrumOverlap) / (double)SAMPLE_RATE;
+                    ImPlot::SetNextPlotLimits(0.0, nyquist, -history, 0.0, ImGuiCond_Always);
+                    if (ImPlot::BeginPlot("##Spectrogram", 0, 0, ImVec2(-1, -1), ImPlotFlags_NoLegend | ImPlotFlags_NoMenus,
+                        ImPlotAxisFlags_NoGridLines, ImPlotAxisFlags_NoGridLines)) {
+                        ImPlot::PlotHeatmap("", &frame.spectrogram[0], spectrogramRows, spectrogramColumns, spectrumFloor, 0.0, NULL,
+                            ImPlotPoint(0.0, -history), ImPlotPoint(nyquist, 0.0));
+                        ImPlot::EndPlot();
+                    }
+                }
+            }
+
+            ImGui::End();
+        }
+        spectrumAnalyzer.setEnabled(spectrumVisible);
+
+        if (showMidiFile) {
+            ImGui::Begin("MIDI file", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+
+            ImGui::SetNextItemWidth(300);
+            ImGui::InputText("##path", midiPath, sizeof(midiPath));
+            ImGui::SameLine();
+            if (ImGui::Button("Load")) {
+                loadSong(midiPath);
+            }
+            ImGui::TextUnformatted(midiStatus.c_str());
+            if (loadedSong && midiPlayer.isPlaying()) {
+                if (ImGui::Button("Stop")) {
+                    midiPlayer.stop(playerNote);
+                }
+                ImGui::SameLine();
+                ImGui::Text("%.1f / %.1f s", midiPlayer.position(engineFrame.load(memory_order_relaxed), SAMPLE_RATE),
+                    (double)loadedSong->lengthFrames / SAMPLE_RATE);
+            } else if (loadedSong && ImGui::Button("Play")) {
+                midiPlayer.play(loadedSong, engineFrame.load(memory_order_relaxed) + (uint64_t)(midiLookahead * SAMPLE_RATE));
+            }
+
+            ImGui::End();
+        }
+
         if (showGlobal) {
             ImGui::Begin("Global", NULL, ImGuiWindowFlags_AlwaysAutoResize);
 
             //ImGui::Checkbox("Hold note", &holdNote);
-            ImGui::SliderFloat("Amplitude", &gAmplitude, 0.0, 0.1);
+            if (ImGui::SliderFloat("Amplitude", &gAmplitude, 0.0, 0.1)) {
+                sendCommand(cmdMasterAmplitude, 0, 0, gAmplitude);
+            }
+            if (ImGui::SliderFloat("Pitch bend", &gPitchBend, -2.0, 2.0, "%.2f st")) {
+                sendCommand(cmdPitchBend, 0, 0, gPitchBend);
+            }
+            // springs back to the centre like a bend wheel
+            if (ImGui::IsItemDeactivated() && gPitchBend != 0.0f) {
+                gPitchBend = 0.0f;
+                sendCommand(cmdPitchBend, 0, 0, gPitchBend);
+            }
+            if (ImGui::SliderFloat("Vibrato rate", &gVibratoRate, 0.1, 12.0, "%.1f Hz")) {
+                sendCommand(cmdVibratoRate, 0, 0, gVibratoRate);
+            }
+            if (ImGui::SliderFloat("Vibrato depth", &gVibratoDepth, 0.0, 1.0, "%.2f st")) {
+                sendCommand(cmdVibratoDepth, 0, 0, gVibratoDepth);
+            }
+            if (ImGui::SliderFloat("Attack", &gEnvelope.attack, 0.001f, 5.0f, "%.3f s", ImGuiSliderFlags_Logarithmic)) {
+                sendCommand(cmdAttack, 0, 0, gEnvelope.attack);
+            }
+            if (ImGui::SliderFloat("Decay", &gEnvelope.decay, 0.001f, 5.0f, "%.3f s", ImGuiSliderFlags_Logarithmic)) {
+                sendCommand(cmdDecay, 0, 0, gEnvelope.decay);
+            }
+            if (ImGui::SliderFloat("Sustain", &gEnvelope.sustain, 0.0f, 1.0f, "%.2f")) {
+                sendCommand(cmdSustain, 0, 0, gEnvelope.sustain);
+            }
+            if (ImGui::SliderFloat("Release", &gEnvelope.release, 0.001f, 10.0f, "%.3f s", ImGuiSliderFlags_Logarithmic)) {
+                sendCommand(cmdRelease, 0, 0, gEnvelope.release);
+            }
             //if (holdNote) {
             //    ImGui::Text("Active note: %s", &(MIDI_number_to_name[prevNote])[0]);
             //} else if (soundOn) {
@@ -312,10 +664,99 @@ int main(void)
             //    ImGui::Text("Active note: %s", &(MIDI_number_to_name[128])[0]);
             //}
             ImGui::Text("Application average %.3f ms/frame (%.1f FPS)", 1000.0f / ImGui::GetIO().Framerate, ImGui::GetIO().Framerate);
+            ImGui::Checkbox("Redraw only when needed", &eventDrivenGui);
+            if (eventDrivenGui) {
+                ImGui::SliderInt("Idle FPS", &idleFrameRate, 1, 60, "%d");
+                ImGui::SliderInt("Monitoring FPS", &monitorFrameRate, 1, 120, "%d");
+            }
+            ImGui::Checkbox("Sample-accurate input", &timedInput);
+            if (timedInput) {
+                ImGui::SliderFloat("Input slack", &inputSlack, 0.0f, 50.0f, "%.1f ms");
+                ImGui::Text("Input latency %.1f ms", inputLatency);
+            }
+
+            ImGui::Separator();
+            int polyphony = voiceAllocator.getVoiceCount();
+            if (ImGui::SliderInt("Polyphony", &polyphony, 1, maxPolyphony, "%d")) {
+                voiceAllocator.setVoiceCount(polyphony, [](int, int slot) { pushFreq(midiNone, slot, inputClock()); });
+            }
+            const char* stealPolicies[] = { "None", "Oldest", "Quietest" };
+            int policy = voiceAllocator.policy;
+            if (ImGui::Combo("Voice stealing", &policy, stealPolicies, IM_ARRAYSIZE(stealPolicies))) {
+                voiceAllocator.policy = (stealPolicy)policy;
+            }
+            voiceAllocator.reclaim();
+            ImGui::Text("Notes %d / %d, %d releasing", voiceAllocator.activeCount(), voiceAllocator.getVoiceCount(), voiceAllocator.releasingCount());
+            if (renderPool.workerCount() > 0 && ImGui::SliderInt("Render threads", &renderThreads, 1, renderPool.workerCount() + 1, "%d")) {
+                renderPool.wake(renderThreads);
+                sendCommand(cmdRenderThreads, 0, renderThreads);
+            }
+
+            ImGui::Separator();
+            ImGui::Text("DSP load %5.1f%%  peak %5.1f%%", dspLoad.current() * 100.0f, dspLoad.peak() * 100.0f);
+            ImGui::Text("p50 %3.0f%%  p99 %3.0f%%  p99.9 %3.0f%%", dspLoad.percentile(0.5) * 100.0f, dspLoad.percentile(0.99) * 100.0f, dspLoad.percentile(0.999) * 100.0f);
+            ImGui::Text("Xruns %u", dspLoad.xruns());
+            ImGui::SameLine();
+            if (ImGui::Button("Reset meter")) {
+                dspLoad.reset();
+            }
+
+            ImGui::End();
+        }
+
+        if (showModulation) {
+            ImGui::Begin("Modulation", NULL, ImGuiWindowFlags_AlwaysAutoResize);
+
+            const char* lfoWaves[] = { "Sine", "Triangle", "Saw", "Square", "Sample & hold" };
+            const char* destinations[] = { "Amp", "Detune", "Pan", "Shape", "Cutoff" };
+
+            if (ImGui::SliderInt("Control rate", &gControlInterval, minControlInterval, maxControlInterval, "every %d frames")) {
+                sendCommand(cmdControlRate, 0, gControlInterval);
+            }
+            for (int lfo = 0; lfo < numberOfLFOs; lfo++) {
+                ImGui::PushID(lfo);
+                ImGui::Text("LFO %d", lfo + 1);
+                if (ImGui::Combo("Wave", &gLfoWave[lfo], lfoWaves, IM_ARRAYSIZE(lfoWaves))) {
+                    sendCommand(cmdLfoWave, 0, lfo, gLfoWave[lfo]);
+                }
+                if (ImGui::SliderFloat("Rate", &gLfoRate[lfo], 0.01f, 20.0f, "%.2f Hz", ImGuiSliderFlags_Logarithmic)) {
+                    sendCommand(cmdLfoRate, 0, lfo, gLfoRate[lfo]);
+                }
+                ImGui::PopID();
+            }
+
+            // a row per LFO and stack, a column per destination
+            ImGui::Separator();
+            if (ImGui::BeginTable("Matrix", numberOfModDestinations + 1, ImGuiTableFlags_SizingFixedFit)) {
+                ImGui::TableSetupColumn("");
+                for (int d = 0; d < numberOfModDestinations; d++) {
+                    ImGui::TableSetupColumn(destinations[d]);
+                }
+                ImGui::TableHeadersRow();
+                for (int lfo = 0; lfo < numberOfLFOs; lfo++) {
+                    for (int n = 0; n < numberOfOscStacks; n++) {
+                        ImGui::TableNextRow();
+                        ImGui::TableNextColumn();
+                        ImGui::Text("LFO %d > Osc %d", lfo + 1, n + 1);
+                        for (int d = 0; d < numberOfModDestinations; d++) {
+                            ImGui::TableNextColumn();
+                            ImGui::PushID((lfo * maxOscStacks + n) * numberOfModDestinations + d);
+                            ImGui::SetNextItemWidth(60.0f);
+                            if (ImGui::SliderFloat("##depth", &gModDepth[lfo][n][d], -1.0f, 1.0f, "%.2f")) {
+                                sendCommand(cmdModDepth, n, lfo * numberOfModDestinations + d, gModDepth[lfo][n][d]);
+                            }
+                            ImGui::PopID();
+                        }
+                    }
+                }
+                ImGui::EndTable();
+            }
 
             ImGui::End();
         }
 
+        monitoring = (scopeVisible || spectrumVisible || showGlobal) && engineSounding.load(memory_order_relaxed);
+
         // Rendering
         ImGui::Render();
         int display_w, display_h;
@@ -340,6 +781,8 @@ int main(void)
     err = Pa_CloseStream(stream);
     if (err != paNoError) goto error;
     Pa_Terminate();
+    renderPool.stop();
+    spectrumAnalyzer.stop();
 
     return err;
 
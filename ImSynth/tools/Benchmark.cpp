@@ -0,0 +1,495 @@
+//
+//  Benchmark.cpp
+//
+//  Microbenchmarks for the oscillator engine. Sweeps shape, unison voices,
+//  polyphony and stack count, and writes the results as JSON so runs from
+//  different builds can be compared.
+//
+//  usage: Benchmark [-o results.json] [-quick] [-threads count]
+//
+//  ns_per_sample is the cost of one output sample of the thing measured;
+//  voices_per_core is how many oscillator voices (note x unison voice) one
+//  core could run in realtime at sampleRate, from the cost per voice-sample.
+//
+//  Outside Visual Studio (Benchmark.vcxproj), e.g. on Linux:
+//      g++ -O2 -std=c++17 -I../lib -I../lib/Synth Benchmark.cpp ../lib/Synth/WaveTableOsc.cpp ../lib/Synth/WaveTableCache.cpp ../lib/Synth/RenderPool.cpp -o Benchmark -lpthread
+//
+//  Add -DfixedPointPhase=1 to time, and check, the 32 bit fixed point phase accumulator.
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+
+#include "SynthEngine.h"
+#include "WaveTableCache.h"
+#include "MidiPlayer.h"
+
+using namespace std;
+
+#define benchBlock (256)            // frames per block, as the GUI application's PortAudio stream
+#define benchRepeats (5)            // best of, to stay clear of scheduler noise
+
+static int benchFrames = sampleRate; // frames timed per repeat
+static const int benchPolyphonies[] = { 1, 2, 3, 4, 8, 16, 32, 64, maxPolyphony };
+static const int benchVoices[] = { 1, 2, 4, 8, 16, maxVoices };
+static float sink = 0.0f;           // keeps the optimiser from discarding results
+
+struct benchResult {
+    string name;
+    int shape = -1;
+    int voices = -1;
+    int polyphony = -1;
+    int stacks = -1;
+    int threads = -1;
+    double nsPerSample = 0.0;       // or per call, for the non-audio benchmarks
+    int voicesPerSample = 0;        // oscillator voices rendered per output sample
+};
+
+static vector<benchResult> results;
+
+template <typename F>
+static double bestSeconds(F run)
+{
+    double best = 1e30;
+    for (int r = 0; r < benchRepeats; r++) {
+        auto start = chrono::steady_clock::now();
+        run();
+        best = min(best, chrono::duration<double>(chrono::steady_clock::now() - start).count());
+    }
+    return best;
+}
+
+// spread notes over the keyboard so they land in different mipmap levels
+static double benchNoteFreq(int note)
+{
+    return midiPitches[36 + (note * 7) % 60] / sampleRate;
+}
+
+static void addResult(benchResult r, double seconds, double samples)
+{
+    r.nsPerSample = seconds * 1e9 / samples;
+    results.push_back(r);
+}
+
+static void benchOscillator(int shape, int polyphony)
+{
+    WaveTableOsc osc;
+    osc.setTables(templateTables[shape].get());
+    for (int p = 0; p < polyphony; p++) {
+        osc.setFrequency(benchNoteFreq(p), p);
+    }
+
+    benchResult r;
+    r.shape = shape;
+    r.polyphony = polyphony;
+    r.voicesPerSample = polyphony;
+
+    r.name = "WaveTableOsc::process";
+    addResult(r, bestSeconds([&] {
+        float acc = 0.0f;
+        for (int n = 0; n < benchFrames; n++) {
+            acc += osc.process();
+        }
+        sink += acc;
+    }), benchFrames);
+
+    vector<float> out(benchBlock);
+    r.name = "WaveTableOsc::processBlock";
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < benchFrames; n += benchBlock) {
+            fill(out.begin(), out.end(), 0.0f);
+            osc.processBlock(&out[0], benchBlock);
+        }
+        sink += out[0];
+    }), benchFrames);
+}
+
+// the oscillator's output against a reference with a double phase and double interpolation, for the
+// phase accumulator in use (fixedPointPhase); over phaseCheckSeconds any drift in the phase shows up.
+// The notes are detuned as unison voices are, so that their increments are not the round values
+// of the float note pitches, which a fixed point phase would hold exactly
+#define phaseCheckSeconds (10)
+#define phaseCheckDetune (1.0071)   // about 12 cents
+
+static double phaseMaxError = 0.0;
+
+static void checkPhaseAccuracy()
+{
+    const waveTableBank* bank = templateTables[2].get();  // the saw, the steepest shape
+    vector<float> out(benchBlock);
+    for (int note = 0; note < 60; note += 7) {
+        double inc = benchNoteFreq(note) * phaseCheckDetune;
+        WaveTableOsc osc;
+        osc.setTables(bank);
+        osc.setPhases(0.0f);
+        osc.setFrequency(inc, 0);
+        const waveTableLevel* level = &bank->levels[levelForIncrement(bank, inc)];
+
+        double phase = 0.0;
+        for (int n = 0; n < phaseCheckSeconds * sampleRate; n += benchBlock) {
+            fill(out.begin(), out.end(), 0.0f);
+            osc.processBlock(&out[0], benchBlock);
+            for (int i = 0; i < benchBlock; i++) {
+                phase += inc;
+                phase -= floor(phase);
+                double position = phase * level->waveTableLen;
+                int index = (int)position;
+                double frac = position - index;
+                double expected = level->samples[index] + (level->samples[index + 1] - level->samples[index]) * frac;
+                phaseMaxError = max(phaseMaxError, fabs(out[i] - expected));
+            }
+        }
+    }
+}
+
+// a type 0 file with zero length notes, the off at the same tick as the on (as drum tracks have),
+// in both note off forms and with a tempo change among them: through the loader and the player,
+// every note on must be followed by its note off
+static int midiStuckNotes = 0;
+
+static void checkMidiLoader()
+{
+    const uint8_t track[] = {
+        0x00, 0x90, 60, 100,                // note on
+        0x00, 60, 0,                        // note off, as a note on with velocity 0 in running status
+        0x00, 0xff, 0x51, 0x03, 0x07, 0xa1, 0x20,  // tempo, 120 bpm
+        0x0a, 0x90, 62, 100,
+        0x00, 0x80, 62, 64,                 // note off
+        0x0a, 0x90, 64, 100,
+        0x0a, 0x80, 64, 64,                 // and an ordinary note, for comparison
+        0x00, 0xff, 0x2f, 0x00,
+    };
+    const uint8_t header[] = { 'M', 'T', 'h', 'd', 0, 0, 0, 6, 0, 0, 0, 1, 0x01, 0xe0, 'M', 'T', 'r', 'k', 0, 0, 0, (uint8_t)sizeof(track) };
+    vector<uint8_t> bytes(sizeof(header) + sizeof(track));
+    copy(header, header + sizeof(header), bytes.begin());
+    copy(track, track + sizeof(track), bytes.begin() + sizeof(header));
+
+    auto song = make_shared<midiSong>();
+    if (!parseMidiFile(bytes, "the MIDI check", *song, sampleRate)) {
+        midiStuckNotes = -1;
+        return;
+    }
+    bool sounding[noOfMIDINotes] = {};
+    MidiPlayer player;
+    player.play(song, 0);
+    player.schedule(song->lengthFrames + 1, (int)song->events.size(), [&](int key, float velocity, uint64_t) {
+        sounding[key] = velocity > 0.0f;
+        return true;
+    });
+    midiStuckNotes = (int)count(sounding, sounding + noOfMIDINotes, true);
+    if (midiStuckNotes != 0) {
+        fprintf(stderr, "Error: %d notes from the MIDI check were left sounding\n", midiStuckNotes);
+    }
+}
+
+static void benchStack(int shape, int voices, int polyphony)
+{
+    WaveTableOscStack stack;
+    stack.setAllTables(templateTables[shape]);
+    stack.setVoices(voices);
+    stack.setDetune(50.0);
+    for (int p = 0; p < polyphony; p++) {
+        stack.setFrequencies(benchNoteFreq(p), p);
+    }
+
+    benchResult r;
+    r.shape = shape;
+    r.voices = voices;
+    r.polyphony = polyphony;
+    r.voicesPerSample = voices * polyphony;
+
+    r.name = "WaveTableOscStack::processAll";
+    addResult(r, bestSeconds([&] {
+        float acc = 0.0f;
+        for (int n = 0; n < benchFrames; n++) {
+            acc += stack.processAll();
+        }
+        sink += acc;
+    }), benchFrames);
+
+    vector<float> out(benchBlock);
+    r.name = "WaveTableOscStack::processBlock";
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < benchFrames; n += benchBlock) {
+            fill(out.begin(), out.end(), 0.0f);
+            stack.processBlock(&out[0], benchBlock);
+        }
+        sink += out[0];
+    }), benchFrames);
+
+    vector<float> right(benchBlock);
+    stack.setSpread(100.0);
+    r.name = "WaveTableOscStack::processBlockStereo";
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < benchFrames; n += benchBlock) {
+            fill(out.begin(), out.end(), 0.0f);
+            fill(right.begin(), right.end(), 0.0f);
+            stack.processBlockStereo(&out[0], &right[0], benchBlock, 0, stack.numNoteVoices());
+        }
+        sink += out[0] + right[0];
+    }), benchFrames);
+
+    // every note through its own resonant low pass, key tracked so each note has its own coefficients
+    stack.setFilterMode(filterLowPass);
+    stack.setFilterCutoff(2000.0f);
+    stack.filterResonance = 0.5f;
+    stack.filterKeyTrack = 1.0f;
+    r.name = "WaveTableOscStack::processBlockStereo (filtered)";
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < benchFrames; n += benchBlock) {
+            fill(out.begin(), out.end(), 0.0f);
+            fill(right.begin(), right.end(), 0.0f);
+            stack.processBlockStereo(&out[0], &right[0], benchBlock, 0, stack.numNoteVoices());
+        }
+        sink += out[0] + right[0];
+    }), benchFrames);
+    stack.setFilterMode(filterOff);
+
+    // vibrato of a semitone either side, so notes cross table levels
+    vector<float> pitch(benchBlock);
+    for (int n = 0; n < benchBlock; n++) {
+        pitch[n] = (float)exp2(sin(2.0 * M_PI * n / benchBlock) / 12.0);
+    }
+    r.name = "WaveTableOscStack::processBlock (pitch modulated)";
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < benchFrames; n += benchBlock) {
+            fill(out.begin(), out.end(), 0.0f);
+            stack.processBlock(&out[0], benchBlock, &pitch[0]);
+        }
+        sink += out[0];
+    }), benchFrames);
+}
+
+static void benchSetFrequencies(int voices)
+{
+    WaveTableOscStack stack;
+    stack.setAllTables(templateTables[0]);
+    stack.setVoices(voices);
+    stack.setDetune(50.0);
+
+    const int calls = 100000;
+    benchResult r;
+    r.name = "WaveTableOscStack::setFrequencies";
+    r.voices = voices;
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < calls; n++) {
+            stack.setFrequencies(benchNoteFreq(n), n % maxPolyphony);
+        }
+    }), calls);
+}
+
+// the full callback path: every stack in use, mixed by renderBlock
+static void benchEngine(int stacks, int polyphony, int threads = 1)
+{
+    renderPool.wake(threads);
+    renderPool.setActiveThreads(threads);
+    const int voices = 8;      // a typical supersaw, and comparable with runs from before maxVoices grew
+    engine.numberOfOscStacks = stacks;
+    for (int s = 0; s < maxOscStacks; s++) {
+        oscStacks[s].setAllTables(templateTables[s % numberOfShapes]);
+        oscStacks[s].setVoices(voices);
+        oscStacks[s].setDetune(50.0);
+        for (int p = 0; p < maxPolyphony; p++) {
+            oscStacks[s].setFrequencies(p < polyphony ? benchNoteFreq(p) : 0.0, p);
+        }
+    }
+
+    benchResult r;
+    r.name = "renderBlock";
+    r.voices = voices;
+    r.polyphony = polyphony;
+    r.stacks = stacks;
+    r.threads = renderPool.activeThreads();
+    r.voicesPerSample = stacks * voices * polyphony;
+
+    vector<float> out(benchBlock * 2);
+    addResult(r, bestSeconds([&] {
+        for (int n = 0; n < benchFrames; n += benchBlock) {
+            renderBlock(&out[0], benchBlock, 2);
+        }
+        sink += out[0];
+    }), benchFrames);
+}
+
+// the same with every stack's amplitude, pan and detune on an LFO, so blocks are split at every tick
+static void benchModulatedEngine(int stacks, int polyphony, int controlInterval)
+{
+    modulation.setInterval(controlInterval);
+    for (int s = 0; s < maxOscStacks; s++) {
+        modulation.setDepth(0, s, modAmplitude, 0.5f);
+        modulation.setDepth(0, s, modPan, 0.5f);
+        modulation.setDepth(1, s, modDetune, 0.2f);
+    }
+    benchEngine(stacks, polyphony);
+    results.back().name = "renderBlock (modulated, every " + to_string(controlInterval) + " frames)";
+    for (int s = 0; s < maxOscStacks; s++) {
+        for (int d = 0; d < numberOfModDestinations; d++) {
+            modulation.setDepth(0, s, d, 0.0f);
+            modulation.setDepth(1, s, d, 0.0f);
+        }
+    }
+    modulation.setInterval(defaultControlInterval);
+}
+
+static void benchMakeAllTables()
+{
+    benchResult r;
+    r.name = "makeAllTables";
+    addResult(r, bestSeconds([&] {
+        vector<sharedWaveTableBank> banks(numberOfShapes);
+        makeAllTables(&banks, baseFrequency);
+        sink += banks[0]->storage[1];
+    }), 1);
+}
+
+// start-up from the cache: map the file and set up the level pointers
+static void benchLoadTableCache()
+{
+    const char* path = "Benchmark_wavetables.bin";
+    vector<sharedWaveTableBank> banks(numberOfShapes);
+    makeAllTables(&banks, baseFrequency);
+    if (!saveTableCache(path, banks, baseFrequency)) {
+        fprintf(stderr, "Warning: cannot write %s, skipping loadTableCache\n", path);
+        return;
+    }
+
+    benchResult r;
+    r.name = "loadTableCache";
+    addResult(r, bestSeconds([&] {
+        vector<sharedWaveTableBank> mapped(numberOfShapes);
+        if (loadTableCache(path, &mapped, baseFrequency)) {
+            sink += mapped[0]->levels[0].samples[1];
+        }
+    }), 1);
+    remove(path);
+}
+
+static void writeJson(FILE* out)
+{
+    const double budgetNs = 1e9 / sampleRate;
+
+    fprintf(out, "{\n");
+    fprintf(out, "  \"sampleRate\": %d,\n", sampleRate);
+    fprintf(out, "  \"blockFrames\": %d,\n", benchBlock);
+    fprintf(out, "  \"simdKernel\": %s,\n", useSIMDKernel ? "true" : "false");
+    fprintf(out, "  \"fixedPointPhase\": %s,\n", fixedPointPhase ? "true" : "false");
+    fprintf(out, "  \"phaseCheck\": {\"seconds\": %d, \"maxError\": %.3g},\n", phaseCheckSeconds, phaseMaxError);
+    fprintf(out, "  \"midiCheck\": {\"stuckNotes\": %d},\n", midiStuckNotes);
+    fprintf(out, "  \"maxPolyphony\": %d,\n", maxPolyphony);
+    fprintf(out, "  \"maxVoices\": %d,\n", maxVoices);
+    fprintf(out, "  \"maxOscStacks\": %d,\n", maxOscStacks);
+    size_t bankBytes = 0;
+    for (const auto& bank : templateTables) {
+        for (const auto& level : bank->levels) {
+            bankBytes += (level.waveTableLen + 1) * sizeof(float);
+        }
+    }
+    fprintf(out, "  \"bankBytes\": %zu,\n", bankBytes);
+    fprintf(out, "  \"minTableLen\": %d,\n", constantRatioLimit);
+    fprintf(out, "  \"results\": [\n");
+    for (size_t i = 0; i < results.size(); i++) {
+        const benchResult& r = results[i];
+        fprintf(out, "    {\"name\": \"%s\"", r.name.c_str());
+        if (r.shape >= 0) fprintf(out, ", \"shape\": %d", r.shape);
+        if (r.voices >= 0) fprintf(out, ", \"voices\": %d", r.voices);
+        if (r.polyphony >= 0) fprintf(out, ", \"polyphony\": %d", r.polyphony);
+        if (r.stacks >= 0) fprintf(out, ", \"stacks\": %d", r.stacks);
+        if (r.threads >= 0) fprintf(out, ", \"threads\": %d", r.threads);
+        if (r.voicesPerSample > 0) {
+            double nsPerVoice = r.nsPerSample / r.voicesPerSample;
+            fprintf(out, ", \"ns_per_sample\": %.3f, \"ns_per_voice_sample\": %.3f, \"voices_per_core\": %.1f",
+                r.nsPerSample, nsPerVoice, budgetNs / nsPerVoice);
+        } else {
+            fprintf(out, ", \"ns_per_call\": %.3f", r.nsPerSample);
+        }
+        fprintf(out, "}%s\n", i + 1 < results.size() ? "," : "");
+    }
+    fprintf(out, "  ]\n}\n");
+}
+
+int main(int argc, char* argv[])
+{
+    const char* outPath = NULL;
+    int maxThreads = (int)thread::hardware_concurrency();
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-o" && i + 1 < argc) {
+            outPath = argv[++i];
+        } else if (arg == "-quick") {
+            benchFrames = sampleRate / 10;
+        } else if (arg == "-threads" && i + 1 < argc) {
+            maxThreads = min(atoi(argv[++i]), maxThreads);  // no more threads than cores
+        } else {
+            fprintf(stderr, "usage: %s [-o results.json] [-quick] [-threads count]\n", argv[0]);
+            return 1;
+        }
+    }
+
+    benchMakeAllTables();
+    benchLoadTableCache();
+    makeAllTables(&templateTables, baseFrequency);
+    initMidiPitches();
+
+    checkPhaseAccuracy();
+    checkMidiLoader();
+    for (int shape = 0; shape < numberOfShapes; shape++) {
+        for (int polyphony : benchPolyphonies) {
+            benchOscillator(shape, polyphony);
+        }
+    }
+    for (int shape = 0; shape < numberOfShapes; shape++) {
+        for (int voices : benchVoices) {
+            for (int polyphony : benchPolyphonies) {
+                benchStack(shape, voices, polyphony);
+            }
+        }
+    }
+    for (int voices : benchVoices) {
+        benchSetFrequencies(voices);
+    }
+    for (int stacks = 1; stacks <= maxOscStacks; stacks++) {
+        for (int polyphony : benchPolyphonies) {
+            benchEngine(stacks, polyphony);
+        }
+    }
+
+    for (int controlInterval : { minControlInterval, defaultControlInterval, maxControlInterval }) {
+        for (int polyphony : { 16, 64 }) {
+            benchModulatedEngine(maxOscStacks, polyphony, controlInterval);
+        }
+    }
+
+    // the render pool, from two threads up to maxThreads, at the heaviest loads
+    renderPool.start(maxThreads - 1);
+    for (int threads = 2; threads <= renderPool.workerCount() + 1; threads *= 2) {
+        for (int polyphony : { 16, 64, maxPolyphony }) {
+            benchEngine(maxOscStacks, polyphony, threads);
+        }
+        if (threads < renderPool.workerCount() + 1 && threads * 2 > renderPool.workerCount() + 1) {
+            threads = (renderPool.workerCount() + 1) / 2;  // so the last pass uses every thread
+        }
+    }
+    renderPool.stop();
+
+    FILE* out = stdout;
+    if (outPath != NULL) {
+        out = fopen(outPath, "w");
+        if (out == NULL) {
+            fprintf(stderr, "Error: cannot write %s\n", outPath);
+            return 1;
+        }
+    }
+    writeJson(out);
+    if (out != stdout) {
+        fclose(out);
+    }
+
+    // printed so the accumulated output is used
+    fprintf(stderr, "done (%g)\n", sink);
+    return 0;
+}
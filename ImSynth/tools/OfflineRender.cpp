@@ -0,0 +1,373 @@
+//
+//  OfflineRender.cpp
+//
+//  Headless, faster-than-realtime renderer: plays a note script through the
+//  same tables, stacks and renderBlock mix as the PortAudio callback, and
+//  streams the result to a WAV file. No window or sound card is needed.
+//
+//  usage: OfflineRender <script.txt> <out.wav> [-pcm16] [-block frames] [-threads count]
+//
+//  Script lines are "<seconds> <command> [arguments]", in any order; # starts a comment.
+//      on <note> [velocity]        note on, by name (C4, F#2) or MIDI number; velocity 0-1, default 0.75
+//      off <note>                  note off
+//      polyphony <count>           notes at once, 1 to maxPolyphony (default defaultPolyphony)
+//      steal <none|oldest|quietest>    what a note does when every slot is taken (default oldest)
+//      stacks <count>              number of oscillator stacks in use
+//      shape <stack> <0-3>         sine, triangle, saw, square
+//      voices <stack> <count>      unison voices
+//      detune <stack> <0-100>      unison detune
+//      spread <stack> <0-100>      unison pan spread
+//      pan <stack> <-100-100>      stack pan, left to right
+//      amp <stack> <amplitude>     stack amplitude
+//      filter <stack> <0-3> [cutoff Hz] [resonance 0-1] [key track 0-1]   per-note filter: off, low pass, band pass, high pass
+//      cutoff <stack> <Hz>         filter cutoff, gliding to it
+//      gain <amplitude>            master amplitude
+//      bend <semitones>            pitch bend, every note
+//      vibrato <Hz> <semitones>    vibrato rate and depth (depth 0 is off)
+//      adsr <attack> <decay> <sustain> <release>   note envelope: seconds, seconds, level 0-1, seconds
+//      lfo <1-2> <0-4> <Hz>        LFO wave (sine, triangle, saw, square, sample and hold) and rate
+//      mod <1-2> <stack> <amp|detune|pan|shape|cutoff> <depth>    modulation matrix depth, -1 to 1 (0 is off)
+//      controlrate <frames>        frames between modulation ticks, 16 to 64 (default 32)
+//      midi <file.mid>             play a Standard MIDI File (type 0 or 1) from here, stopping any already playing
+//      end                         stop rendering here (default: one second after the last event or MIDI file)
+//
+//  Outside Visual Studio (OfflineRender.vcxproj), e.g. on Linux:
+//      g++ -O2 -std=c++17 -I../lib -I../lib/Synth OfflineRender.cpp ../lib/Synth/WaveTableOsc.cpp ../lib/Synth/WaveTableCache.cpp ../lib/Synth/RenderPool.cpp -o OfflineRender -lpthread
+//
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <iostream>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <chrono>
+#include <map>
+
+#include "SynthEngine.h"
+#include "WaveTableCache.h"
+#include "VoiceAllocator.h"
+#include "WavWriter.h"
+#include "MidiPlayer.h"
+
+using namespace std;
+
+#define renderChannels (2)
+#define defaultRenderBlock (256)
+
+// the script's MIDI files, loaded before rendering starts
+static map<string, shared_ptr<const midiSong>> songs;
+static MidiPlayer midiPlayer;
+static long long frame = 0;
+VoiceAllocator voiceAllocator;
+
+struct scriptEvent {
+    double time;
+    string command;
+    vector<string> args;
+    int line;
+};
+
+static int parseNote(const string& name)
+{
+    auto it = MIDI_name_to_number.find(name);
+    if (it != MIDI_name_to_number.end()) {
+        return it->second;
+    }
+    char* end = NULL;
+    long key = strtol(name.c_str(), &end, 10);
+    if (end == name.c_str() || *end != '\0' || key < 0 || key >= noOfMIDINotes) {
+        return -1;
+    }
+    return (int)key;
+}
+
+static bool loadScript(const char* path, vector<scriptEvent>& events)
+{
+    ifstream file(path);
+    if (!file) {
+        fprintf(stderr, "Error: cannot open script %s\n", path);
+        return false;
+    }
+
+    string text;
+    for (int line = 1; getline(file, text); line++) {
+        text = text.substr(0, text.find('#'));
+        istringstream fields(text);
+        scriptEvent event;
+        if (!(fields >> event.time)) {
+            continue; // blank or comment line
+        }
+        if (!(fields >> event.command) || event.time < 0.0) {
+            fprintf(stderr, "Error: %s:%d: expected <seconds> <command>\n", path, line);
+            return false;
+        }
+        string arg;
+        while (fields >> arg) {
+            event.args.push_back(arg);
+        }
+        event.line = line;
+        events.push_back(event);
+    }
+
+    stable_sort(events.begin(), events.end(), [](const scriptEvent& a, const scriptEvent& b) { return a.time < b.time; });
+    return true;
+}
+
+// single threaded, so a full queue is simply drained into the engine before retrying;
+// commands for later frames just move to the engine's pending list
+static void queueCommand(synthCommandType type, int stack = 0, int intValue = 0, double value = 0.0)
+{
+    while (!sendCommand(type, stack, intValue, value)) {
+        applyCommands();
+    }
+}
+
+static void queueNote(int slot, int key, double frequency, uint64_t atFrame = 0)
+{
+    while (!sendNote(slot, key, frequency, atFrame)) {
+        applyCommands();
+    }
+}
+
+// same slot handling as pianoCallback; velocity 0 is a note off. Always takes the note, making
+// room in the queue when it has to
+static bool playNote(int key, float velocity, uint64_t atFrame)
+{
+    if (velocity > 0.0f) {
+        int slot = voiceAllocator.noteOn(key, velocity);
+        if (slot != VoiceAllocator::noSlot) {
+            queueNote(slot, key, midiPitches[key] / sampleRate, atFrame);
+        }
+    } else {
+        int slot = voiceAllocator.noteOff(key);
+        if (slot != VoiceAllocator::noSlot) {
+            queueNote(slot, key, 0.0, atFrame);
+        }
+    }
+    return true;
+}
+
+static bool stackArg(const scriptEvent& event, int& stack)
+{
+    stack = atoi(event.args[0].c_str());
+    return stack >= 0 && stack < maxOscStacks;
+}
+
+// returns false for a malformed event
+static bool queueEvent(const scriptEvent& event)
+{
+    const string& cmd = event.command;
+    size_t argc = event.args.size();
+    int stack = 0;
+
+    if ((cmd == "on" && (argc == 1 || argc == 2)) || (cmd == "off" && argc == 1)) {
+        int key = parseNote(event.args[0]);
+        if (key < 0) {
+            return false;
+        }
+        playNote(key, cmd == "on" ? (argc == 2 ? (float)atof(event.args[1].c_str()) : 0.75f) : 0.0f, 0);
+    } else if (cmd == "polyphony" && argc == 1) {
+        voiceAllocator.setVoiceCount(atoi(event.args[0].c_str()), [](int, int slot) { queueCommand(cmdNoteFreq, 0, slot, 0.0); });
+    } else if (cmd == "steal" && argc == 1) {
+        const string& policy = event.args[0];
+        if (policy == "none") {
+            voiceAllocator.policy = stealNone;
+        } else if (policy == "oldest") {
+            voiceAllocator.policy = stealOldest;
+        } else if (policy == "quietest") {
+            voiceAllocator.policy = stealQuietest;
+        } else {
+            return false;
+        }
+    } else if (cmd == "stacks" && argc == 1) {
+        queueCommand(cmdStackCount, 0, atoi(event.args[0].c_str()));
+    } else if (cmd == "shape" && argc == 2 && stackArg(event, stack)) {
+        int shape = atoi(event.args[1].c_str());
+        if (shape < 0 || shape >= numberOfShapes) {
+            return false;
+        }
+        queueCommand(cmdShape, stack, shape);
+    } else if (cmd == "voices" && argc == 2 && stackArg(event, stack)) {
+        queueCommand(cmdVoices, stack, atoi(event.args[1].c_str()));
+    } else if (cmd == "detune" && argc == 2 && stackArg(event, stack)) {
+        queueCommand(cmdDetune, stack, 0, atof(event.args[1].c_str()));
+    } else if (cmd == "spread" && argc == 2 && stackArg(event, stack)) {
+        queueCommand(cmdSpread, stack, 0, atof(event.args[1].c_str()));
+    } else if (cmd == "pan" && argc == 2 && stackArg(event, stack)) {
+        queueCommand(cmdPan, stack, 0, atof(event.args[1].c_str()));
+    } else if (cmd == "amp" && argc == 2 && stackArg(event, stack)) {
+        queueCommand(cmdAmplitude, stack, 0, atof(event.args[1].c_str()));
+    } else if (cmd == "filter" && argc >= 2 && argc <= 5 && stackArg(event, stack)) {
+        queueCommand(cmdFilterMode, stack, atoi(event.args[1].c_str()));
+        if (argc >= 3) {
+            queueCommand(cmdFilterCutoff, stack, 0, atof(event.args[2].c_str()));
+        }
+        if (argc >= 4) {
+            queueCommand(cmdFilterResonance, stack, 0, atof(event.args[3].c_str()));
+        }
+        if (argc >= 5) {
+            queueCommand(cmdFilterKeyTrack, stack, 0, atof(event.args[4].c_str()));
+        }
+    } else if (cmd == "cutoff" && argc == 2 && stackArg(event, stack)) {
+        queueCommand(cmdFilterCutoff, stack, 0, atof(event.args[1].c_str()));
+    } else if (cmd == "gain" && argc == 1) {
+        queueCommand(cmdMasterAmplitude, 0, 0, atof(event.args[0].c_str()));
+    } else if (cmd == "bend" && argc == 1) {
+        queueCommand(cmdPitchBend, 0, 0, atof(event.args[0].c_str()));
+    } else if (cmd == "vibrato" && argc == 2) {
+        queueCommand(cmdVibratoRate, 0, 0, atof(event.args[0].c_str()));
+        queueCommand(cmdVibratoDepth, 0, 0, atof(event.args[1].c_str()));
+    } else if (cmd == "adsr" && argc == 4) {
+        queueCommand(cmdAttack, 0, 0, atof(event.args[0].c_str()));
+        queueCommand(cmdDecay, 0, 0, atof(event.args[1].c_str()));
+        queueCommand(cmdSustain, 0, 0, atof(event.args[2].c_str()));
+        queueCommand(cmdRelease, 0, 0, atof(event.args[3].c_str()));
+    } else if (cmd == "lfo" && argc == 3) {
+        int lfo = atoi(event.args[0].c_str()) - 1;
+        if (lfo < 0 || lfo >= numberOfLFOs) {
+            return false;
+        }
+        queueCommand(cmdLfoWave, 0, lfo, atoi(event.args[1].c_str()));
+        queueCommand(cmdLfoRate, 0, lfo, atof(event.args[2].c_str()));
+    } else if (cmd == "mod" && argc == 4) {
+        static const char* destinations[numberOfModDestinations] = { "amp", "detune", "pan", "shape", "cutoff" };
+        int lfo = atoi(event.args[0].c_str()) - 1;
+        stack = atoi(event.args[1].c_str());
+        int destination = (int)(find(destinations, destinations + numberOfModDestinations, event.args[2]) - destinations);
+        if (lfo < 0 || lfo >= numberOfLFOs || stack < 0 || stack >= maxOscStacks || destination == numberOfModDestinations) {
+            return false;
+        }
+        queueCommand(cmdModDepth, stack, lfo * numberOfModDestinations + destination, atof(event.args[3].c_str()));
+    } else if (cmd == "controlrate" && argc == 1) {
+        queueCommand(cmdControlRate, 0, atoi(event.args[0].c_str()));
+    } else if (cmd == "midi" && argc == 1) {
+        midiPlayer.stop(playNote);
+        midiPlayer.play(songs[event.args[0]], frame);
+    } else if (cmd != "end" || argc != 0) {
+        return false;
+    }
+    return true;
+}
+
+int main(int argc, char* argv[])
+{
+    const char* scriptPath = NULL;
+    const char* wavPath = NULL;
+    bool floatFormat = true;
+    int blockFrames = defaultRenderBlock;
+    int threads = 1;
+
+    for (int i = 1; i < argc; i++) {
+        string arg = argv[i];
+        if (arg == "-pcm16") {
+            floatFormat = false;
+        } else if (arg == "-block" && i + 1 < argc) {
+            blockFrames = max(1, atoi(argv[++i]));
+        } else if (arg == "-threads" && i + 1 < argc) {
+            threads = max(1, atoi(argv[++i]));
+        } else if (scriptPath == NULL) {
+            scriptPath = argv[i];
+        } else if (wavPath == NULL) {
+            wavPath = argv[i];
+        } else {
+            scriptPath = NULL;
+            break;
+        }
+    }
+    if (scriptPath == NULL || wavPath == NULL) {
+        fprintf(stderr, "usage: %s <script.txt> <out.wav> [-pcm16] [-block frames] [-threads count]\n", argv[0]);
+        return 1;
+    }
+
+    vector<scriptEvent> events;
+    if (!loadScript(scriptPath, events)) {
+        return 1;
+    }
+
+    double endTime = events.empty() ? 0.0 : events.back().time + 1.0;
+    for (const auto& event : events) {
+        if (event.command == "midi" && event.args.size() == 1) {
+            auto song = make_shared<midiSong>();
+            if (!loadMidiFile(event.args[0].c_str(), *song, sampleRate)) {
+                return 1;
+            }
+            songs[event.args[0]] = song;
+            endTime = max(endTime, event.time + (double)song->lengthFrames / sampleRate + 1.0);
+        }
+    }
+    for (const auto& event : events) {
+        if (event.command == "end") {
+            endTime = event.time;
+            break;
+        }
+    }
+
+    // same start-up as the GUI application
+    loadOrMakeAllTables(&templateTables, baseFrequency);
+    for (int n = 0; n < maxOscStacks; n++) {
+        oscStacks[n].setAllTables(templateTables[0]);
+    }
+    initMidiPitches();
+    voiceAllocator.notesEnded = notesEnded;
+    if (threads > 1) {
+        // no more threads than cores
+        renderPool.start(threads - 1);
+        if (renderPool.workerCount() + 1 < threads) {
+            threads = renderPool.workerCount() + 1;
+            fprintf(stderr, "-threads limited to %d, one per core\n", threads);
+        }
+        renderPool.wake(threads);
+        queueCommand(cmdRenderThreads, 0, threads);
+    }
+
+    WavWriter wav;
+    if (!wav.open(wavPath, sampleRate, renderChannels, floatFormat)) {
+        fprintf(stderr, "Error: cannot write %s\n", wavPath);
+        return 1;
+    }
+
+    vector<float> buffer((size_t)blockFrames * renderChannels);
+    const long long totalFrames = (long long)(endTime * sampleRate + 0.5);
+    size_t nextEvent = 0;
+
+    auto start = chrono::steady_clock::now();
+
+    while (frame < totalFrames) {
+        // queue every event due at this frame; renderBlock applies them before its first sample
+        while (nextEvent < events.size() && (long long)(events[nextEvent].time * sampleRate + 0.5) <= frame) {
+            if (!queueEvent(events[nextEvent])) {
+                fprintf(stderr, "Error: %s:%d: bad '%s' event\n", scriptPath, events[nextEvent].line, events[nextEvent].command.c_str());
+                return 1;
+            }
+            nextEvent++;
+        }
+
+        // blocks are cut short at the next event, so every event lands on its exact sample
+        long long frames = min((long long)blockFrames, totalFrames - frame);
+        if (nextEvent < events.size()) {
+            frames = min(frames, (long long)(events[nextEvent].time * sampleRate + 0.5) - frame);
+        }
+
+        // MIDI file notes go to the engine stamped with their frames, and it splits the block at each
+        midiPlayer.schedule(frame + frames, commandQueueSize, playNote);
+
+        renderBlock(&buffer[0], (unsigned long)frames, renderChannels);
+        if (!wav.write(&buffer[0], (unsigned long)frames)) {
+            fprintf(stderr, "Error: write to %s failed\n", wavPath);
+            return 1;
+        }
+        frame += frames;
+    }
+
+    wav.close();
+    renderPool.stop();
+
+    double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+    double audioSeconds = (double)totalFrames / sampleRate;
+    printf("rendered %.3f s of audio in %.3f s: %.1fx realtime\n", audioSeconds, seconds, seconds > 0.0 ? audioSeconds / seconds : 0.0);
+
+    return 0;
+}